@@ -0,0 +1,314 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "AgentProtocol.h"
+#include "log.h"
+
+using namespace std;
+
+#define AGENT_MAGIC "MUTL"
+#define HEADER_LEN  8  // Magic, version, type.
+
+static void put_le(string &buf, uint64_t v, int bytes) {
+  for (int i = 0; i < bytes; i++) buf.push_back((char) (v >> (8 * i)));
+}
+
+static uint64_t get_le(const char *p, int bytes) {
+  uint64_t v = 0;
+  for (int i = 0; i < bytes; i++) v |= (uint64_t) (uint8_t) p[i] << (8 * i);
+  return v;
+}
+
+static uint64_t double_bits(double d) {
+  uint64_t v;
+  memcpy(&v, &d, sizeof(v));
+  return v;
+}
+
+static double bits_double(uint64_t v) {
+  double d;
+  memcpy(&d, &v, sizeof(d));
+  return d;
+}
+
+AgentMessage::AgentMessage(agent_msg_t type) :
+  msg_type(type), msg_version(AGENT_PROTOCOL_VERSION), buf(AGENT_MAGIC) {
+  put_le(buf, AGENT_PROTOCOL_VERSION, 2);
+  put_le(buf, type, 2);
+}
+
+AgentMessage::AgentMessage(const void *data, size_t len) :
+  buf((const char *) data, len) {
+  const char *p = buf.data();
+
+  if (len < HEADER_LEN || memcmp(p, AGENT_MAGIC, 4))
+    DIE("Agent protocol: not a mutilate message (%zu bytes).  Is the "
+        "peer an older mutilate?", len);
+
+  msg_version = get_le(p + 4, 2);
+  msg_type = (agent_msg_t) get_le(p + 6, 2);
+
+  for (size_t off = HEADER_LEN; off < len;) {
+    if (len - off < 6) DIE("Agent protocol: truncated field header");
+    uint16_t id = get_le(p + off, 2);
+    uint32_t flen = get_le(p + off + 2, 4);
+    off += 6;
+
+    if (len - off < flen) DIE("Agent protocol: truncated field %d", id);
+    fields.insert(make_pair(id, string(p + off, flen)));
+    off += flen;
+  }
+}
+
+void AgentMessage::put_field(uint16_t id, const void *data, size_t len) {
+  put_le(buf, id, 2);
+  put_le(buf, len, 4);
+  buf.append((const char *) data, len);
+}
+
+void AgentMessage::put_u64(uint16_t id, uint64_t v) {
+  string le;
+  put_le(le, v, 8);
+  put_field(id, le.data(), le.size());
+}
+
+void AgentMessage::put_double(uint16_t id, double v) {
+  put_u64(id, double_bits(v));
+}
+
+void AgentMessage::put_string(uint16_t id, const string &v) {
+  put_field(id, v.data(), v.size());
+}
+
+void AgentMessage::put_message(uint16_t id, const AgentMessage &m) {
+  put_string(id, m.encoded());
+}
+
+uint64_t AgentMessage::get_u64(uint16_t id, uint64_t def) const {
+  auto i = fields.find(id);
+  if (i == fields.end()) return def;
+  if (i->second.size() != 8) DIE("Agent protocol: field %d is not a number",
+                                 id);
+  return get_le(i->second.data(), 8);
+}
+
+double AgentMessage::get_double(uint16_t id, double def) const {
+  if (!has(id)) return def;
+  return bits_double(get_u64(id));
+}
+
+string AgentMessage::get_string(uint16_t id, const string &def) const {
+  auto i = fields.find(id);
+  return i == fields.end() ? def : i->second;
+}
+
+vector<string> AgentMessage::get_all(uint16_t id) const {
+  vector<string> values;
+  auto range = fields.equal_range(id);
+  for (auto i = range.first; i != range.second; i++)
+    values.push_back(i->second);
+  return values;
+}
+
+string agent_version_check(int peer_version) {
+  char why[128];
+
+  if (peer_version < AGENT_PROTOCOL_MIN) {
+    snprintf(why, sizeof(why), "peer speaks agent protocol %d, but this "
+             "build needs %d or later", peer_version, AGENT_PROTOCOL_MIN);
+    return why;
+  }
+
+  // Newer versions changed what existing messages mean, which this
+  // build would misread rather than skip.
+  if (peer_version > AGENT_PROTOCOL_VERSION) {
+    snprintf(why, sizeof(why), "peer speaks agent protocol %d, but this "
+             "build only knows up to %d", peer_version,
+             AGENT_PROTOCOL_VERSION);
+    return why;
+  }
+
+  return "";
+}
+
+/*
+ * options_t fields by id.  Ids are fixed once released: add new options
+ * at the end with new ids.
+ */
+enum option_kind_t { OPT_INT, OPT_BOOL, OPT_DOUBLE, OPT_STRING, OPT_IADIST };
+
+struct option_field {
+  uint16_t id;
+  option_kind_t kind;
+  size_t offset;
+  size_t size;
+};
+
+#define OPTION(id, kind, name) \
+  { id, kind, offsetof(options_t, name), sizeof(((options_t *) 0)->name) }
+
+static const option_field option_fields[] = {
+  OPTION(1,  OPT_INT,    connections),
+  OPTION(2,  OPT_BOOL,   blocking),
+  OPTION(3,  OPT_DOUBLE, lambda),
+  OPTION(4,  OPT_INT,    qps),
+  OPTION(5,  OPT_INT,    records),
+  OPTION(6,  OPT_INT,    misswindow),
+  OPTION(7,  OPT_INT,    queries),
+  OPTION(8,  OPT_INT,    assoc),
+  OPTION(9,  OPT_STRING, file_name),
+  OPTION(10, OPT_BOOL,   read_file),
+  OPTION(11, OPT_BOOL,   binary),
+  OPTION(12, OPT_BOOL,   unix_socket),
+  OPTION(13, OPT_BOOL,   successful_queries),
+  OPTION(14, OPT_BOOL,   use_assoc),
+  OPTION(15, OPT_BOOL,   redis),
+  OPTION(16, OPT_BOOL,   getset),
+  OPTION(17, OPT_BOOL,   getsetorset),
+  OPTION(18, OPT_BOOL,   delete90),
+  OPTION(19, OPT_BOOL,   sasl),
+  OPTION(20, OPT_STRING, username),
+  OPTION(21, OPT_STRING, password),
+  OPTION(22, OPT_STRING, prefix),
+  OPTION(23, OPT_STRING, hashtype),
+  OPTION(24, OPT_STRING, keysize),
+  OPTION(25, OPT_STRING, valuesize),
+  OPTION(26, OPT_STRING, ia),
+  OPTION(27, OPT_INT,    twitter_trace),
+  OPTION(28, OPT_DOUBLE, update),
+  OPTION(29, OPT_INT,    time),
+  OPTION(30, OPT_BOOL,   loadonly),
+  OPTION(31, OPT_INT,    depth),
+  OPTION(32, OPT_BOOL,   no_nodelay),
+  OPTION(33, OPT_BOOL,   noload),
+  OPTION(34, OPT_INT,    threads),
+  OPTION(35, OPT_IADIST, iadist),
+  OPTION(36, OPT_INT,    warmup),
+  OPTION(37, OPT_BOOL,   skip),
+  OPTION(38, OPT_BOOL,   roundrobin),
+  OPTION(39, OPT_INT,    server_given),
+  OPTION(40, OPT_INT,    lambda_denom),
+  OPTION(41, OPT_BOOL,   oob_thread),
+  OPTION(42, OPT_BOOL,   moderate),
+  OPTION(43, OPT_INT,    hotkeys),
+  OPTION(44, OPT_BOOL,   wire_timestamps),
+  OPTION(45, OPT_BOOL,   kernel_timestamps),
+  OPTION(46, OPT_STRING, engine),
+  OPTION(47, OPT_INT,    busy_poll),
+  OPTION(48, OPT_INT,    so_busy_poll),
+};
+
+void put_options(AgentMessage &m, const options_t &options) {
+  const char *base = (const char *) &options;
+
+  for (auto &f: option_fields) {
+    const char *p = base + f.offset;
+
+    switch (f.kind) {
+    case OPT_INT:    m.put_i64(f.id, *(const int *) p); break;
+    case OPT_BOOL:   m.put_u64(f.id, *(const bool *) p); break;
+    case OPT_DOUBLE: m.put_double(f.id, *(const double *) p); break;
+    case OPT_STRING: m.put_string(f.id, string(p, strnlen(p, f.size))); break;
+    case OPT_IADIST:
+      m.put_i64(f.id, *(const distribution_t *) p);
+      break;
+    }
+  }
+}
+
+void get_options(const AgentMessage &m, options_t *options) {
+  char *base = (char *) options;
+
+  for (auto &f: option_fields) {
+    if (!m.has(f.id)) continue;
+    char *p = base + f.offset;
+
+    switch (f.kind) {
+    case OPT_INT:    *(int *) p = m.get_i64(f.id); break;
+    case OPT_BOOL:   *(bool *) p = m.get_u64(f.id) != 0; break;
+    case OPT_DOUBLE: *(double *) p = m.get_double(f.id); break;
+    case OPT_STRING: {
+      string s = m.get_string(f.id);
+      if (s.size() >= f.size)
+        DIE("Agent protocol: option %d is %zu bytes, more than %zu", f.id,
+            s.size(), f.size - 1);
+      memcpy(p, s.c_str(), s.size() + 1);
+      break;
+    }
+    case OPT_IADIST:
+      *(distribution_t *) p = (distribution_t) m.get_i64(f.id);
+      break;
+    }
+  }
+}
+
+// Fields of a histogram; bins are packed as u64s.
+enum { HIST_SUM = 1, HIST_SUM_SQ, HIST_BINS };
+
+#if !defined(USE_ADAPTIVE_SAMPLER) && !defined(USE_HISTOGRAM_SAMPLER)
+static AgentMessage encode_hist(const LogHistogramSampler &h) {
+  AgentMessage m(MSG_STATS);
+  string bins;
+
+  for (uint64_t b: h.bins) put_le(bins, b, 8);
+  m.put_double(HIST_SUM, h.sum);
+  m.put_double(HIST_SUM_SQ, h.sum_sq);
+  m.put_string(HIST_BINS, bins);
+  return m;
+}
+
+// Bins beyond ours (from a peer with more of them) go in our last.
+static void decode_hist(const string &encoded, LogHistogramSampler *h) {
+  AgentMessage m(encoded.data(), encoded.size());
+  string bins = m.get_string(HIST_BINS);
+
+  for (size_t i = 0; i < bins.size() / 8; i++)
+    h->bins[min(i, h->bins.size() - 1)] += get_le(bins.data() + i * 8, 8);
+  h->sum += m.get_double(HIST_SUM);
+  h->sum_sq += m.get_double(HIST_SUM_SQ);
+}
+#endif
+
+AgentMessage encode_stats(ConnectionStats &stats) {
+  AgentMessage m(MSG_STATS);
+
+  m.put_u64(STAT_RX_BYTES, stats.rx_bytes);
+  m.put_u64(STAT_TX_BYTES, stats.tx_bytes);
+  m.put_u64(STAT_GETS, stats.gets);
+  m.put_u64(STAT_SETS, stats.sets);
+  m.put_u64(STAT_ACCESSES, stats.accesses);
+  m.put_u64(STAT_GET_MISSES, stats.get_misses);
+  m.put_u64(STAT_SKIPS, stats.skips);
+  m.put_double(STAT_START, stats.start);
+  m.put_double(STAT_STOP, stats.stop);
+
+#if !defined(USE_ADAPTIVE_SAMPLER) && !defined(USE_HISTOGRAM_SAMPLER)
+  m.put_message(STAT_GET_HIST, encode_hist(stats.get_sampler));
+  m.put_message(STAT_SET_HIST, encode_hist(stats.set_sampler));
+#endif
+
+  return m;
+}
+
+void decode_stats(const AgentMessage &m, AgentStats *as,
+                  ConnectionStats *latency) {
+  as->rx_bytes = m.get_u64(STAT_RX_BYTES);
+  as->tx_bytes = m.get_u64(STAT_TX_BYTES);
+  as->gets = m.get_u64(STAT_GETS);
+  as->sets = m.get_u64(STAT_SETS);
+  as->accesses = m.get_u64(STAT_ACCESSES);
+  as->get_misses = m.get_u64(STAT_GET_MISSES);
+  as->skips = m.get_u64(STAT_SKIPS);
+  as->start = m.get_double(STAT_START);
+  as->stop = m.get_double(STAT_STOP);
+
+#if !defined(USE_ADAPTIVE_SAMPLER) && !defined(USE_HISTOGRAM_SAMPLER)
+  if (latency) {
+    if (m.has(STAT_GET_HIST))
+      decode_hist(m.get_string(STAT_GET_HIST), &latency->get_sampler);
+    if (m.has(STAT_SET_HIST))
+      decode_hist(m.get_string(STAT_SET_HIST), &latency->set_sampler);
+  }
+#endif
+}
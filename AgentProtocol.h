@@ -0,0 +1,153 @@
+/* -*- c++ -*- */
+#ifndef AGENTPROTOCOL_H
+#define AGENTPROTOCOL_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "AgentStats.h"
+#include "ConnectionOptions.h"
+#include "ConnectionStats.h"
+
+// Version of the messages below.  A change that older builds can
+// safely ignore, such as a new field, does not need a new version;
+// bump it when the meaning of existing messages changes, and raise
+// AGENT_PROTOCOL_MIN to the oldest version this build still handles.
+#define AGENT_PROTOCOL_VERSION 1
+#define AGENT_PROTOCOL_MIN     1
+
+enum agent_msg_t {
+  MSG_ERROR = 1,      // field 1: reason.
+  MSG_PREPARE,        // Options, servers and --profile; see put_options().
+  MSG_PREPARED,       // Agent's threads * --lambda_mul and weight.
+  MSG_LAMBDA_DENOM,
+  MSG_ACK,
+  MSG_SYNC_REQ,
+  MSG_SYNC,           // Agent is ready to start.
+  MSG_TIME_REQ,
+  MSG_TIME,           // Agent's get_time().
+  MSG_START,          // Instant to start at, on the agent's clock.
+  MSG_STATS_REQ,
+  MSG_STATS,          // See encode_stats().
+  MSG_HEARTBEAT,      // Agent -> master, on its own PUB socket.
+  MSG_BALANCE,        // Master -> agent, likewise; see rebalance().
+};
+
+// Fields of the messages besides options and stats.  Each message's
+// ids are its own.
+enum {
+  ERROR_REASON = 1,
+  PREPARE_SERVER = 1000,  // Repeated; above the options_t ids.
+  PREPARE_PROFILE,        // --profile spec, if any.
+  PREPARE_TRACE_SHARD,    // Part of --read_file to replay: shard of
+  PREPARE_TRACE_SHARDS,   // shards, by key hash.
+  PREPARE_AGENT,          // Repeated: endpoints of agents to relay to.
+  PREPARE_FANOUT,         // --agent_fanout, for splitting them further.
+  PREPARE_HEARTBEAT,      // --heartbeat seconds, 0 for none.
+  PREPARE_PROBE_QPS,      // Only to a --probe: its QPS.
+  PREPARE_CALIBRATE,      // --calibrate seconds, 0 for none.
+  PREPARED_NUM = 1,
+  PREPARED_WEIGHT,        // Part of lambda_denom, subtree included.
+  PREPARED_AGENTS,        // Agents in the subtree, this one included.
+  PREPARED_PROBE,         // 1 if running as a --probe.
+  PREPARED_CAPACITY,      // If calibrated: the subtree's lowest
+  PREPARED_CAPACITY_QPS,  // capacity per unit of weight, and that
+  PREPARED_CAPACITY_AGENT,  // agent's capacity and host:pid.
+  LAMBDA_DENOM = 1,
+  LAMBDA_ABORT,           // 1 to skip this run.
+  SYNC_LEAD = 1,          // Time a relay needs to pass MSG_START on.
+  TIME_NOW = 1,
+  START_AT = 1,
+};
+
+// Fields of MSG_HEARTBEAT, totals over the agent's threads.
+enum {
+  HB_AGENT = 1,    // host:pid
+  HB_QPS,          // Achieved over the last --heartbeat.
+  HB_TARGET,       // Assigned by lambda, or 0 if unpaced.
+  HB_SHARE,        // HB_TARGET before MSG_BALANCE scaled it.
+  HB_OUTSTANDING,  // Requests in flight.
+  HB_LAG,          // Worst event loop lag, in us.
+  HB_SKIPS,
+  BALANCE_SCALE,   // MSG_BALANCE, for HB_AGENT: of its lambda_denom share.
+};
+
+// Fields of MSG_STATS.  Histograms are sub-messages of the sampler's
+// sum, sum of squares and bins.
+enum {
+  STAT_RX_BYTES = 1,
+  STAT_TX_BYTES,
+  STAT_GETS,
+  STAT_SETS,
+  STAT_ACCESSES,
+  STAT_GET_MISSES,
+  STAT_SKIPS,
+  STAT_START,
+  STAT_STOP,
+  STAT_GET_HIST,
+  STAT_SET_HIST,
+  STAT_PROFILE_STEP = 100,  // Repeated: each --profile step's stats.
+};
+
+// One agent protocol message, encoded explicitly rather than copied
+// from memory, so that master and agent need not be the same build:
+//
+//   "MUTL" u16 version u16 type, then fields of u16 id u32 length data
+//
+// Integers are little-endian, doubles their IEEE 754 bits as a u64.
+// Field ids are never reused, and readers skip fields they do not
+// know, so new fields reach older agents harmlessly.  A field may
+// repeat, e.g. one per server.
+class AgentMessage {
+public:
+  AgentMessage(agent_msg_t type);
+  AgentMessage(const void *data, size_t len);  // DIE()s if malformed.
+
+  agent_msg_t type() const { return msg_type; }
+  int version() const { return msg_version; }
+  const std::string &encoded() const { return buf; }
+
+  void put_u64(uint16_t id, uint64_t v);
+  void put_i64(uint16_t id, int64_t v) { put_u64(id, (uint64_t) v); }
+  void put_double(uint16_t id, double v);
+  void put_string(uint16_t id, const std::string &v);
+  void put_message(uint16_t id, const AgentMessage &m);
+
+  bool has(uint16_t id) const { return fields.count(id) > 0; }
+  uint64_t get_u64(uint16_t id, uint64_t def = 0) const;
+  int64_t get_i64(uint16_t id, int64_t def = 0) const {
+    return (int64_t) get_u64(id, (uint64_t) def);
+  }
+  double get_double(uint16_t id, double def = 0) const;
+  std::string get_string(uint16_t id, const std::string &def = "") const;
+  std::vector<std::string> get_all(uint16_t id) const;
+
+private:
+  agent_msg_t msg_type;
+  int msg_version;
+  std::string buf;
+  std::multimap<uint16_t, std::string> fields;  // Decoded messages only.
+
+  void put_field(uint16_t id, const void *data, size_t len);
+};
+
+// Check a peer's version against ours: AGENT_PROTOCOL_MIN up to
+// AGENT_PROTOCOL_VERSION.  Returns "" if we can talk to it, else why not.
+std::string agent_version_check(int peer_version);
+
+// options_t, field by field.  get_options() leaves fields that the
+// message lacks as they were, e.g. from args_to_options().
+void put_options(AgentMessage &m, const options_t &options);
+void get_options(const AgentMessage &m, options_t *options);
+
+// Counters, start and stop, and the get and set latency histograms
+// where the sampler keeps them.
+AgentMessage encode_stats(ConnectionStats &stats);
+void decode_stats(const AgentMessage &m, AgentStats *as,
+                  ConnectionStats *latency = NULL);
+
+#endif // AGENTPROTOCOL_H
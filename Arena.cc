@@ -0,0 +1,141 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#include <new>
+
+#include "Arena.h"
+#include "log.h"
+
+static thread_local Arena *current_arena = NULL;
+
+Arena *Arena::current() { return current_arena; }
+void Arena::set_current(Arena *arena) { current_arena = arena; }
+
+Arena::Arena(size_t bytes) : top(0), huge(false), full(false) {
+  size = (bytes + HUGE_PAGE_SIZE - 1) & ~((size_t) HUGE_PAGE_SIZE - 1);
+  memset(free_lists, 0, sizeof(free_lists));
+
+#ifdef MAP_HUGETLB
+  base = (char *) mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (base != MAP_FAILED) {
+    huge = true;
+    return;
+  }
+  D("mmap(MAP_HUGETLB) of %zu MB failed: %s", size >> 20, strerror(errno));
+#endif
+
+  // Over-allocate so the region can start on a 2MB boundary, which
+  // transparent hugepages need.
+  char *raw = (char *) mmap(NULL, size + HUGE_PAGE_SIZE,
+                            PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED) DIE("mmap() of %zu MB arena: %s", size >> 20,
+                             strerror(errno));
+
+  base = (char *) (((uintptr_t) raw + HUGE_PAGE_SIZE - 1) &
+                   ~((uintptr_t) HUGE_PAGE_SIZE - 1));
+  if (base > raw) munmap(raw, base - raw);
+  munmap(base + size, raw + HUGE_PAGE_SIZE - base);
+
+#ifdef MADV_HUGEPAGE
+  if (madvise(base, size, MADV_HUGEPAGE))
+    W("madvise(MADV_HUGEPAGE): %s; --hugepages will use 4K pages.",
+      strerror(errno));
+#endif
+}
+
+Arena::~Arena() {
+  if (current_arena == this) current_arena = NULL;
+  munmap(base, size);
+}
+
+void *Arena::alloc(size_t bytes) {
+  size_t rounded = (bytes + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+  int cls = rounded / ARENA_ALIGN - 1;
+
+  if (rounded == 0 || cls >= ARENA_CLASSES) return ::operator new(bytes);
+
+  if (free_lists[cls]) {
+    void *p = free_lists[cls];
+    free_lists[cls] = *(void **) p;
+    return p;
+  }
+
+  if (top + rounded > size) {
+    if (!full) W("Arena of %zu MB is full; falling back to the heap.  "
+                 "See --arena_size.", size >> 20);
+    full = true;
+    return ::operator new(bytes);
+  }
+
+  void *p = base + top;
+  top += rounded;
+  return p;
+}
+
+void Arena::release(void *p, size_t bytes) {
+  if (p == NULL) return;
+  if (!contains(p)) {
+    ::operator delete(p);
+    return;
+  }
+
+  size_t rounded = (bytes + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+  int cls = rounded / ARENA_ALIGN - 1;
+
+  *(void **) p = free_lists[cls];
+  free_lists[cls] = p;
+}
+
+MemCounters::MemCounters() : fd(-1) {
+#ifdef __linux__
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB |
+    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  // This thread, on any CPU.
+  fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  if (fd < 0) D("perf_event_open(dTLB misses): %s", strerror(errno));
+#endif
+}
+
+MemCounters::~MemCounters() {
+  if (fd >= 0) close(fd);
+}
+
+mem_stats MemCounters::read() {
+  mem_stats s;
+  struct rusage ru;
+
+#ifdef RUSAGE_THREAD
+  getrusage(RUSAGE_THREAD, &ru);
+#else
+  getrusage(RUSAGE_SELF, &ru);
+#endif
+  s.minor_faults = ru.ru_minflt;
+  s.major_faults = ru.ru_majflt;
+
+  s.dtlb_misses = -1;
+  long long count;
+  if (fd >= 0 && ::read(fd, &count, sizeof(count)) == sizeof(count))
+    s.dtlb_misses = count;
+
+  return s;
+}
@@ -0,0 +1,103 @@
+/* -*- c++ -*- */
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define ARENA_ALIGN    16
+#define ARENA_CLASSES  64  // Free lists for sizes up to 64 * ARENA_ALIGN.
+
+// One thread's region of memory on 2MB pages, for --hugepages: taken
+// with MAP_HUGETLB if the system has hugepages reserved, else as
+// ordinary memory marked for transparent hugepages.  Connections,
+// their pending requests and other small per-connection allocations
+// come from it, so that a thread's working set spans few TLB entries.
+//
+// Small blocks are recycled through per-size free lists; larger ones,
+// and any once the arena is full, come from the heap.  An arena is
+// only used by the thread that made it current.
+class Arena {
+public:
+  Arena(size_t bytes);
+  ~Arena();
+
+  void *alloc(size_t size);
+  void release(void *p, size_t size);  // p may be from the heap fallback.
+  bool contains(const void *p) const {
+    return (const char *) p >= base && (const char *) p < base + size;
+  }
+
+  bool hugetlb() const { return huge; }
+  size_t used() const { return top; }
+
+  // The calling thread's arena, or NULL.
+  static Arena *current();
+  static void set_current(Arena *arena);
+
+private:
+  char *base;
+  size_t size;
+  size_t top;
+  bool huge;
+  bool full;   // Warned about running out.
+  void *free_lists[ARENA_CLASSES];
+
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+};
+
+// Standard allocator over an Arena, for containers owned by
+// connections.  With a NULL arena it is the plain heap.
+template <class T>
+struct ArenaAllocator {
+  typedef T value_type;
+
+  Arena *arena;
+
+  ArenaAllocator(Arena *_arena = NULL) : arena(_arena) {}
+  template <class U>
+  ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+
+  T *allocate(size_t n) {
+    if (arena) return (T *) arena->alloc(n * sizeof(T));
+    return (T *) ::operator new(n * sizeof(T));
+  }
+
+  void deallocate(T *p, size_t n) {
+    if (arena) arena->release(p, n * sizeof(T));
+    else ::operator delete(p);
+  }
+};
+
+template <class T, class U>
+bool operator==(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) {
+  return a.arena == b.arena;
+}
+
+template <class T, class U>
+bool operator!=(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) {
+  return a.arena != b.arena;
+}
+
+// Page faults and dTLB load misses of the calling thread, to see what
+// --hugepages buys.  dTLB misses need perf_event_open() and read as -1
+// where it is not permitted.
+struct mem_stats {
+  long minor_faults;
+  long major_faults;
+  long long dtlb_misses;
+};
+
+class MemCounters {
+public:
+  MemCounters();
+  ~MemCounters();
+
+  mem_stats read();
+
+private:
+  int fd;
+};
+
+#endif // ARENA_H
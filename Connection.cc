@@ -3,6 +3,11 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#endif
+
 #include <pthread.h>
 
 #include <event2/buffer.h>
@@ -131,46 +136,62 @@ void Connection::output_op(Operation *op, int type, bool found) {
     write(2,output,strlen(output));
 }
 
+static uint32_t next_cid() {
+  pthread_mutex_lock(&cid_lock);
+  uint32_t id = connids++;
+  pthread_mutex_unlock(&cid_lock);
+  return id;
+}
+
 /**
- * Create a new connection to a server endpoint.
+ * Create a new connection to a server endpoint.  Generators, options
+ * and stats come from the thread's shared context.
  */
 Connection::Connection(struct event_base* _base, struct evdns_base* _evdns,
-                       string _hostname, string _port, options_t _options,
+                       string _hostname, string _port,
+                       ConnectionContext *_context,
                        ConcurrentQueue<string>* a_trace_queue,
-                       bool sampling ) :
-  start_time(0), stats(sampling), options(_options),
-  hostname(_hostname), port(_port), base(_base), evdns(_evdns)
+                       IOEngine *_engine) :
+  cid(next_cid()), context(_context), options(_context->options),
+  stats(_context->stats_for(args.connection_stats_given ?
+                            _hostname + ":" + _port + "#" + to_string(cid) :
+                            _hostname + ":" + _port)),
+  start_time(0), finished_count(NULL), connect_cb(NULL), connect_arg(NULL),
+  hostname(_hostname), port(_port), base(_base), evdns(_evdns),
+  engine(_engine),
+  op_queue(0, std::hash<uint32_t>(), std::equal_to<uint32_t>(),
+           op_map::allocator_type(Arena::current()))
 {
-  valuesize = createGenerator(options.valuesize);
-  keysize = createGenerator(options.keysize);
-
   trace_queue = a_trace_queue;
   eof = 0;
-
-  keygen = new KeyGenerator(keysize, options.records);
-
-  if (options.lambda <= 0) {
-    iagen = createGenerator("0");
-  } else {
-    D("iagen = createGenerator(%s)", options.ia);
-    iagen = createGenerator(options.ia);
-    iagen->set_lambda(options.lambda);
-  }
+  issued_queries = 0;
+  finished = false;
 
   read_state  = INIT_READ;
   write_state = INIT_WRITE;
 
   last_tx = last_rx = 0.0;
-
-  last_miss = 0;
-  pthread_mutex_lock(&cid_lock);
-  cid = connids++;
-  pthread_mutex_unlock(&cid_lock);
-  timer = evtimer_new(base, timer_cb, this);
+  tx_flushed = 0;
+  rx_event = NULL;
+  last_krx = 0.0;
+  tx_pending = options.wire_timestamps ?
+    new tx_queue(tx_queue::allocator_type(Arena::current())) : NULL;
+  ktx_pending = options.kernel_timestamps ?
+    new tx_queue(tx_queue::allocator_type(Arena::current())) : NULL;
+
+  bev = NULL;
+  prot = NULL;
+
+  timer.cb = timer_cb;
+  timer.arg = this;
 }
 
 int Connection::do_connect() {
 
+  // Left over from a failed attempt.
+  delete prot;
+  prot = NULL;
+
   int connected = 0;
   if (options.unix_socket) {
   
@@ -200,6 +221,7 @@ int Connection::do_connect() {
         err = errno;
 	fprintf(stderr,"error %s\n",strerror(err));
         bufferevent_free(bev);
+        bev = NULL;
         //event_base_free(_evbase_ptr);
     }
   } else {
@@ -220,25 +242,52 @@ int Connection::do_connect() {
         connected = 1;
     } else {
         bufferevent_free(bev);
+        bev = NULL;
         connected = 0;
     }
   }
+
+  if (connected && (options.wire_timestamps || options.kernel_timestamps))
+    evbuffer_add_cb(bufferevent_get_output(bev), output_cb, this);
+
   return connected;
 }
 
+/**
+ * Give up on a do_connect() attempt that has not resolved yet, as if it
+ * had failed.
+ */
+void Connection::abort_connect() {
+  D("Connecting to %s:%s timed out.", hostname.c_str(), port.c_str());
+
+  bufferevent_free(bev);
+  bev = NULL;
+  if (connect_cb) connect_cb(this, false, connect_arg);
+}
+
+void *Connection::operator new(size_t size) {
+  Arena *arena = Arena::current();
+  return arena ? arena->alloc(size) : ::operator new(size);
+}
+
+void Connection::operator delete(void *p, size_t size) {
+  Arena *arena = Arena::current();
+  if (arena) arena->release(p, size);
+  else ::operator delete(p);
+}
+
 /**
  * Destroy a connection, performing cleanup.
  */
 Connection::~Connection() {
-  event_free(timer);
-  timer = NULL;
+  context->wheel->del(&timer);
+  if (rx_event) event_free(rx_event);
   // FIXME:  W("Drain op_q?");
-  bufferevent_free(bev);
-
-  delete iagen;
-  delete keygen;
-  delete keysize;
-  delete valuesize;
+  engine->detach(this);
+  if (bev) bufferevent_free(bev);
+  delete prot;
+  delete tx_pending;
+  delete ktx_pending;
 }
 
 /**
@@ -247,10 +296,13 @@ Connection::~Connection() {
 void Connection::reset() {
   // FIXME: Actually check the connection, drain all bufferevents, drain op_q.
   assert(op_queue.size() == 0);
-  evtimer_del(timer);
+  context->wheel->del(&timer);
+  if (tx_pending) tx_pending->clear();
+  if (ktx_pending) ktx_pending->clear();
   read_state = IDLE;
   write_state = INIT_WRITE;
-  stats = ConnectionStats(stats.sampling);
+  finished = false;
+  issued_queries = 0;
 }
 
 /**
@@ -273,9 +325,9 @@ void Connection::start_loading() {
     if (loader_issued >= options.records) break;
     char key[256];
     int index = lrand48() % (1024 * 1024);
-    string keystr = keygen->generate(loader_issued);
+    string keystr = context->keygen->generate(loader_issued);
     strcpy(key, keystr.c_str());
-    issue_set(key, &random_char[index], valuesize->generate());
+    issue_set(key, &random_char[index], context->valuesize->generate());
     loader_issued++;
   }
 }
@@ -287,12 +339,12 @@ void Connection::issue_something(double now) {
   char key[256];
   memset(key,0,256);
   // FIXME: generate key distribution here!
-  string keystr = keygen->generate(lrand48() % options.records);
+  string keystr = context->keygen->generate(lrand48() % options.records);
   strncpy(key, keystr.c_str(),255);
 
   if (drand48() < options.update) {
     int index = lrand48() % (1024 * 1024);
-    issue_set(key, &random_char[index], valuesize->generate(), now);
+    issue_set(key, &random_char[index], context->valuesize->generate(), now);
   } else {
     issue_get(key, now);
   }
@@ -310,11 +362,11 @@ void Connection::issue_getset(double now) {
         string keystr;
         char key[256];
         memset(key,0,256);
-        keystr = keygen->generate(lrand48() % options.records);
+        keystr = context->keygen->generate(lrand48() % options.records);
         strncpy(key, keystr.c_str(),255);
         
         char log[1024];
-        int length = valuesize->generate();
+        int length = context->valuesize->generate();
         sprintf(log,"%s,%d\n",key,length);
         write(2,log,strlen(log));
         
@@ -462,11 +514,11 @@ int Connection::issue_getsetorset(double now) {
         string keystr;
         char key[256];
         memset(key,0,256);
-        keystr = keygen->generate(lrand48() % options.records);
+        keystr = context->keygen->generate(lrand48() % options.records);
         strncpy(key, keystr.c_str(),255);
         
         char log[1024];
-        int length = valuesize->generate();
+        int length = context->valuesize->generate();
         sprintf(log,"%s,%d\n",key,length);
         write(2,log,strlen(log));
         
@@ -625,8 +677,10 @@ int Connection::issue_get_with_len(const char* key, int valuelen, double now) {
     //if (read_state == IDLE) read_state = WAITING_FOR_GET;
     l = prot->get_request(key,op.opaque);
     if (read_state != LOADING) stats.tx_bytes += l;
+    if (options.wire_timestamps || options.kernel_timestamps) track_tx(op.opaque);
     
     stats.log_access(op);
+    issued_queries++;
     return 1;
   //} else {
   // return 0;
@@ -664,6 +718,7 @@ void Connection::issue_get(const char* key, double now) {
   pthread_mutex_unlock(&opaque_lock);
   
   op.key = string(key);
+  op.valuelen = 0;
   op.type = Operation::GET;
   op.hv = hashstr(op.key);
   //item_lock(op.hv,cid);
@@ -672,8 +727,10 @@ void Connection::issue_get(const char* key, double now) {
   if (read_state == IDLE) read_state = WAITING_FOR_GET;
   l = prot->get_request(key,op.opaque);
   if (read_state != LOADING) stats.tx_bytes += l;
+  if (options.wire_timestamps || options.kernel_timestamps) track_tx(op.opaque);
   
   stats.log_access(op);
+  issued_queries++;
 }
 
 /**
@@ -753,9 +810,12 @@ void Connection::issue_set_miss(const char* key, const char* value, int length,
   //if (read_state == IDLE) read_state = WAITING_FOR_SET;
   l = prot->set_request(key, value, length, op.opaque);
   if (read_state != LOADING) stats.tx_bytes += l;
+  if (options.wire_timestamps || options.kernel_timestamps) track_tx(op.opaque);
 
-  if (is_access)
+  if (is_access) {
       stats.log_access(op);
+      issued_queries++;
+  }
 }
 
 /**
@@ -798,9 +858,12 @@ int Connection::issue_set(const char* key, const char* value, int length,
     //if (read_state == IDLE) read_state = WAITING_FOR_SET;
     l = prot->set_request(key, value, length, op.opaque);
     if (read_state != LOADING) stats.tx_bytes += l;
+    if (options.wire_timestamps || options.kernel_timestamps) track_tx(op.opaque);
 
-    if (is_access)
+    if (is_access) {
         stats.log_access(op);
+        issued_queries++;
+    }
     return 1;
   //} else {
   //  return 0;
@@ -837,6 +900,40 @@ void Connection::pop_op(Operation *op) {
   //}
 }
 
+/**
+ * Record a completed operation in the stats.
+ */
+void Connection::record_op(Operation *op, int was_hit) {
+  if (options.successful_queries && was_hit) { 
+    switch (op->type) {
+    case Operation::GET: stats.log_get(*op); break;
+    case Operation::SET: stats.log_set(*op); break;
+    case Operation::DELETE: break;
+    default: DIE("Not implemented.");
+    }
+  } else {
+    switch (op->type) {
+    case Operation::GET: stats.log_get(*op); break;
+    case Operation::SET: stats.log_set(*op); break;
+    case Operation::DELETE: break;
+    default: DIE("Not implemented.");
+    }
+  }
+
+  if (context->interval) {
+    if (op->type == Operation::GET) context->interval->log_get(*op);
+    else if (op->type == Operation::SET) context->interval->log_set(*op);
+  }
+
+  if (op->type != Operation::DELETE)
+    stats.log_key(*op, op->type == Operation::GET && !was_hit);
+  stats.log_wire(*op);
+  if (options.kernel_timestamps) {
+    op->krx_time = last_krx;
+    stats.log_kernel(*op);
+  }
+}
+
 /**
  * Finish up (record stats) an operation that just returned from the
  * server.
@@ -856,21 +953,9 @@ void Connection::finish_op(Operation *op, int was_hit) {
   op->end_time = now;
 #endif
 
-  if (options.successful_queries && was_hit) { 
-    switch (op->type) {
-    case Operation::GET: stats.log_get(*op); break;
-    case Operation::SET: stats.log_set(*op); break;
-    case Operation::DELETE: break;
-    default: DIE("Not implemented.");
-    }
-  } else {
-    switch (op->type) {
-    case Operation::GET: stats.log_get(*op); break;
-    case Operation::SET: stats.log_set(*op); break;
-    case Operation::DELETE: break;
-    default: DIE("Not implemented.");
-    }
-  }
+  // Requests issued before the stats window, i.e. during --warmup,
+  // complete as usual but are not recorded.
+  if (op->start_time >= context->window_start) record_op(op, was_hit);
 
   last_rx = now;
   op_queue.erase(op->opaque);
@@ -910,21 +995,9 @@ void Connection::finish_op_miss(Operation *op, int was_hit) {
   op->end_time = now;
 #endif
 
-  if (options.successful_queries && was_hit) { 
-    switch (op->type) {
-    case Operation::GET: stats.log_get(*op); break;
-    case Operation::SET: stats.log_set(*op); break;
-    case Operation::DELETE: break;
-    default: DIE("Not implemented.");
-    }
-  } else {
-    switch (op->type) {
-    case Operation::GET: stats.log_get(*op); break;
-    case Operation::SET: stats.log_set(*op); break;
-    case Operation::DELETE: break;
-    default: DIE("Not implemented.");
-    }
-  }
+  // Requests issued before the stats window, i.e. during --warmup,
+  // complete as usual but are not recorded.
+  if (op->start_time >= context->window_start) record_op(op, was_hit);
 
   last_rx = now;
   //we are atomically issuing a set 
@@ -954,9 +1027,49 @@ void Connection::finish_op_miss(Operation *op, int was_hit) {
 
 
 /**
- * Check if our testing is done and we should exit.
+ * Check if our testing is done and we should exit.  The first time it
+ * is, count this connection in *finished_count.
  */
 bool Connection::check_exit_condition(double now) {
+  if (finished) return true;
+  if (!exit_condition(now)) return false;
+
+  finished = true;
+  if (finished_count) (*finished_count)++;
+  return true;
+}
+
+/**
+ * Bytes of memory this connection holds on its own, i.e. not counting
+ * the thread's shared context, libevent's bufferevent or the kernel's
+ * socket buffers.  Container overheads are estimates.
+ */
+size_t Connection::footprint() {
+  typedef tx_queue pending_t;
+  size_t bytes = sizeof(*this);
+
+  if (hostname.capacity() > 15) bytes += hostname.capacity() + 1;
+  if (port.capacity() > 15) bytes += port.capacity() + 1;
+
+  if (rx_event) bytes += event_get_struct_event_size();
+
+  if (prot) bytes += options.binary ? sizeof(ProtocolBinary) :
+              options.redis ? sizeof(ProtocolRESP) : sizeof(ProtocolAscii);
+
+  // Pipeline slots: a node per outstanding request plus the buckets.
+  bytes += op_queue.bucket_count() * sizeof(void*);
+  bytes += op_queue.size() *
+    (sizeof(std::pair<const uint32_t,Operation>) + 2 * sizeof(void*));
+
+  // libstdc++ allocates a 512-byte block and its map up front.
+  for (pending_t *p: {tx_pending, ktx_pending})
+    if (p) bytes += sizeof(pending_t) + 512 + 8 * sizeof(void*) +
+             p->size() * sizeof(pending_t::value_type);
+
+  return bytes;
+}
+
+bool Connection::exit_condition(double now) {
   if (read_state == INIT_READ) return false;
   if (now == 0.0) now = get_time();
 
@@ -975,7 +1088,7 @@ bool Connection::check_exit_condition(double now) {
 
   } else {
     if (options.queries != 0 && 
-       (((long unsigned)options.queries) == (stats.accesses))) 
+       (((long unsigned)options.queries) == issued_queries)) 
     {
         return true;
     }
@@ -1006,11 +1119,31 @@ void Connection::event_callback(short events) {
         DIE("setsockopt()");
     }
 
+    if (options.so_busy_poll && !options.unix_socket)
+      enable_busy_poll(fd);
+    if (options.kernel_timestamps) enable_kernel_timestamps(fd);
+    engine->attach(this, bev);
+
     read_state = CONN_SETUP;
     if (prot->setup_connection_w()) {
       read_state = IDLE;
     }
 
+    if (connect_cb) connect_cb(this, true, connect_arg);
+
+  } else if (events & BEV_EVENT_ERROR && read_state == INIT_READ) {
+    // The connect itself failed.  Drop the socket; whoever called
+    // do_connect() decides whether to try again.
+    int err = bufferevent_socket_get_dns_error(bev);
+    if (err) D("DNS error for %s: %s", hostname.c_str(),
+               evutil_gai_strerror(err));
+    else D("Connecting to %s:%s failed: %s", hostname.c_str(), port.c_str(),
+           evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+
+    bufferevent_free(bev);
+    bev = NULL;
+    if (connect_cb) connect_cb(this, false, connect_arg);
+
   } else if (events & BEV_EVENT_ERROR) {
     int err = bufferevent_socket_get_dns_error(bev);
     //if (err) DIE("DNS error: %s", evutil_gai_strerror(err));
@@ -1082,6 +1215,176 @@ void Connection::event_callback(short events) {
   }
 }
 
+/**
+ * Turn on software TX/RX timestamping and take over reads from the
+ * bufferevent.  OPT_ID numbers TX timestamps by stream byte offset,
+ * which lines up with the offsets recorded by track_tx() as long as this
+ * runs before anything is written to the socket.
+ *
+ * Kernel timestamps are CLOCK_REALTIME, the same clock as get_time().
+ */
+void Connection::enable_kernel_timestamps(int fd) {
+#ifdef __linux__
+  int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE |
+    SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_ID |
+    SOF_TIMESTAMPING_OPT_TSONLY;
+
+  if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+    DIE("setsockopt(SO_TIMESTAMPING): %s", strerror(errno));
+
+  bufferevent_disable(bev, EV_READ);
+  rx_event = event_new(base, fd, EV_READ | EV_PERSIST, raw_read_cb, this);
+  event_add(rx_event, NULL);
+#endif
+}
+
+/**
+ * Ask the kernel to busy-poll the NIC queue behind this socket instead
+ * of waiting for an interrupt.  Raising it above net.core.busy_read
+ * needs CAP_NET_ADMIN, so failure only warns (once per process).
+ */
+void Connection::enable_busy_poll(int fd) {
+#ifdef SO_BUSY_POLL
+  static bool warned = false;
+  int us = options.so_busy_poll;
+
+  if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us)) < 0 &&
+      !warned) {
+    W("setsockopt(SO_BUSY_POLL): %s", strerror(errno));
+    warned = true;
+  }
+#ifdef SO_PREFER_BUSY_POLL
+  int one = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one)) < 0 &&
+      !warned) {
+    W("setsockopt(SO_PREFER_BUSY_POLL): %s", strerror(errno));
+    warned = true;
+  }
+#endif
+#endif
+}
+
+/**
+ * CPU the kernel last received this connection's packets on, or -1.
+ */
+int Connection::incoming_cpu() {
+#ifdef SO_INCOMING_CPU
+  int cpu = -1;
+  socklen_t len = sizeof(cpu);
+  int fd = bufferevent_getfd(bev);
+
+  if (fd < 0 || options.unix_socket ||
+      getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0)
+    return -1;
+  return cpu;
+#else
+  return -1;
+#endif
+}
+
+/**
+ * Collect TX timestamps from the socket error queue.
+ */
+void Connection::drain_errqueue(int fd) {
+#ifdef __linux__
+  char control[512];
+
+  while (1) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) return;
+
+    struct timespec *ts = NULL;
+    struct sock_extended_err *serr = NULL;
+
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+      if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPING)
+        ts = (struct timespec *) CMSG_DATA(c);
+      else if ((c->cmsg_level == SOL_IP && c->cmsg_type == IP_RECVERR) ||
+               (c->cmsg_level == SOL_IPV6 && c->cmsg_type == IPV6_RECVERR))
+        serr = (struct sock_extended_err *) CMSG_DATA(c);
+    }
+
+    if (ts && serr && serr->ee_errno == ENOMSG &&
+        serr->ee_origin == SO_EE_ORIGIN_TIMESTAMPING)
+      mark_ktx(serr->ee_data, ts[0].tv_sec + (double) ts[0].tv_nsec / 1000000000);
+  }
+#endif
+}
+
+/**
+ * Stamp ktx_time on every request whose last byte is at or before
+ * last_byte.  Offsets are 32 bits on the wire, so compare modulo 2^32.
+ */
+void Connection::mark_ktx(uint32_t last_byte, double ts) {
+  while (ktx_pending->size() > 0 &&
+         (int32_t) (last_byte + 1 - (uint32_t) ktx_pending->front().first) >= 0) {
+    auto op = op_queue.find(ktx_pending->front().second);
+    if (op != op_queue.end() && op->second.ktx_time == 0.0)
+      op->second.ktx_time = ts;
+    ktx_pending->pop_front();
+  }
+}
+
+/**
+ * Read path used with --kernel_timestamps.  Data is fed into the
+ * bufferevent's input buffer so the protocol parsers are unchanged.
+ */
+void Connection::raw_read_callback() {
+#ifdef __linux__
+  int fd = bufferevent_getfd(bev);
+  struct evbuffer *input = bufferevent_get_input(bev);
+  char buf[16384];
+  char control[512];
+
+  drain_errqueue(fd);
+
+  // Only a read that carried its own SCM_TIMESTAMPING stamps this batch.
+  // Wakeups for TX timestamps on the error queue read nothing, and
+  // completions must not pick up a previous batch's RX time.
+  last_krx = 0.0;
+
+  while (1) {
+    struct iovec iov = { buf, sizeof(buf) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(fd, &msg, MSG_DONTWAIT);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) break;
+      event_del(rx_event);
+      event_callback(BEV_EVENT_ERROR);
+      return;
+    } else if (n == 0) {
+      event_del(rx_event);
+      event_callback(BEV_EVENT_EOF);
+      return;
+    }
+
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+      if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPING) {
+        struct timespec *ts = (struct timespec *) CMSG_DATA(c);
+        double krx = ts[0].tv_sec + (double) ts[0].tv_nsec / 1000000000;
+        if (krx > 0.0) last_krx = krx;
+      }
+    }
+
+    evbuffer_add(input, buf, n);
+    if ((size_t) n < sizeof(buf)) break;
+  }
+
+  if (last_krx > 0.0) stats.log_lag((get_time() - last_krx) * 1000000);
+  if (evbuffer_get_length(input) > 0) read_callback();
+#endif
+}
+
 /**
  * Request generation loop. Determines whether or not to issue a new command,
  * based on timer events.
@@ -1092,7 +1395,6 @@ void Connection::drive_write_machine(double now) {
   if (now == 0.0) now = get_time();
 
   double delay;
-  struct timeval tv;
 
   if (check_exit_condition(now)) {
       return;
@@ -1101,10 +1403,9 @@ void Connection::drive_write_machine(double now) {
   while (1) {
     switch (write_state) {
     case INIT_WRITE:
-      delay = iagen->generate();
+      delay = context->iagen->generate();
       next_time = now + delay;
-      double_to_tv(delay, &tv);
-      evtimer_add(timer, &tv);
+      context->wheel->add(&timer, delay);
       write_state = WAITING_FOR_TIME;
       break;
 
@@ -1112,6 +1413,10 @@ void Connection::drive_write_machine(double now) {
       if (op_queue.size() >= (size_t) options.depth) {
         write_state = WAITING_FOR_OPQ;
         return;
+      } else if (options.lambda > 0 && now < next_time) {
+        // Open loop at --qps: hold off until the next scheduled send.
+        write_state = WAITING_FOR_TIME;
+        break;
       }
       //uncommenting for lowest delay possible
       //if (op_queue.size() >= (size_t) options.depth) {
@@ -1133,14 +1438,17 @@ void Connection::drive_write_machine(double now) {
 
       if (options.getsetorset) {
         int ret = issue_getsetorset(now);
-        if (ret) return; //if at EOF
+        if (ret) { //if at EOF
+          check_exit_condition(now);
+          return;
+        }
       } else {
         issue_something(now);
       }
       
       last_tx = now;
       stats.log_op(op_queue.size());
-      //next_time += iagen->generate();
+      if (options.lambda > 0) next_time += context->iagen->generate();
 
       //if (options.skip && options.lambda > 0.0 &&
       //    now - next_time > 0.005000 &&
@@ -1148,18 +1456,15 @@ void Connection::drive_write_machine(double now) {
 
       //  while (next_time < now - 0.004000) {
       //    stats.skips++;
-      //    next_time += iagen->generate();
+      //    next_time += context->iagen->generate();
       //  }
       //}
       break;
 
     case WAITING_FOR_TIME:
       if (now < next_time) {
-        if (!event_pending(timer, EV_TIMEOUT, NULL)) {
-          delay = next_time - now;
-          double_to_tv(delay, &tv);
-          evtimer_add(timer, &tv);
-        }
+        if (!timer.pending())
+          context->wheel->add(&timer, next_time - now);
         return;
       }
       write_state = ISSUING;
@@ -1201,7 +1506,7 @@ void Connection::read_callback() {
       break;
     }
       
-    int obj_size;
+    int obj_size = 0;
     uint32_t opaque;
     bool full_read = prot->handle_response(input, done, found, obj_size, opaque);
     if (full_read) {
@@ -1238,6 +1543,7 @@ void Connection::read_callback() {
                     
                 } else {
                     if (found) {
+                        if (obj_size > 0) op->valuelen = obj_size;
                         finish_op(op,1);
                     } else {
                         finish_op(op,0);
@@ -1340,10 +1646,10 @@ void Connection::read_callback() {
     //      if (loader_issued >= options.records) break;
 
     //      char key[256];
-    //      string keystr = keygen->generate(loader_issued);
+    //      string keystr = context->keygen->generate(loader_issued);
     //      strcpy(key, keystr.c_str());
     //      int index = lrand48() % (1024 * 1024);
-    //      issue_set(key, &random_char[index], valuesize->generate());
+    //      issue_set(key, &random_char[index], context->valuesize->generate());
 
     //      loader_issued++;
     //    }
@@ -1362,15 +1668,69 @@ void Connection::read_callback() {
   }
 }
 
+/**
+ * Remember where in the output stream the request for opaque ends, so
+ * output_callback() can tell when its last byte reaches the kernel.
+ */
+void Connection::track_tx(uint32_t opaque) {
+  uint64_t end = tx_flushed + evbuffer_get_length(bufferevent_get_output(bev));
+  if (options.wire_timestamps) tx_pending->push_back(std::make_pair(end, opaque));
+  if (options.kernel_timestamps) ktx_pending->push_back(std::make_pair(end, opaque));
+}
+
+/**
+ * Stamp send_time on every request whose bytes have all been flushed.
+ */
+void Connection::mark_tx(double now) {
+  if (tx_pending == NULL) return; // Only --kernel_timestamps.
+
+  while (tx_pending->size() > 0 && tx_pending->front().first <= tx_flushed) {
+    auto op = op_queue.find(tx_pending->front().second);
+    if (op != op_queue.end() && op->second.send_time == 0.0)
+      op->second.send_time = now;
+    tx_pending->pop_front();
+  }
+}
+
 /**
  * Callback called when write requests finish.
  */
-void Connection::write_callback() {}
+void Connection::write_callback() {
+  // The output buffer is empty, so every tracked request is out.
+  if (options.wire_timestamps && tx_pending->size() > 0) {
+#if HAVE_CLOCK_GETTIME
+    mark_tx(get_time_accurate());
+#else
+    mark_tx(get_time());
+#endif
+  }
+}
+
+/**
+ * Callback for output evbuffer changes.  Drained bytes were just handed
+ * to the kernel by libevent's write handler.
+ */
+void Connection::output_callback(const struct evbuffer_cb_info *info) {
+  if (info->n_deleted == 0) return;
+  tx_flushed += info->n_deleted;
+#if HAVE_CLOCK_GETTIME
+  mark_tx(get_time_accurate());
+#else
+  mark_tx(get_time());
+#endif
+}
 
 /**
  * Callback for timer timeouts.
  */
-void Connection::timer_callback() { drive_write_machine(); }
+void Connection::timer_callback() {
+  double now = get_time();
+
+  if (write_state == WAITING_FOR_TIME && now > next_time)
+    stats.log_lag((now - next_time) * 1000000);
+
+  drive_write_machine(now);
+}
 
 
 /* The follow are C trampolines for libevent callbacks. */
@@ -1390,7 +1750,18 @@ void bev_write_cb(struct bufferevent *bev, void *ptr) {
   conn->write_callback();
 }
 
-void timer_cb(evutil_socket_t fd, short what, void *ptr) {
+void output_cb(struct evbuffer *buf, const struct evbuffer_cb_info *info,
+               void *ptr) {
+  Connection* conn = (Connection*) ptr;
+  conn->output_callback(info);
+}
+
+void raw_read_cb(evutil_socket_t fd, short what, void *ptr) {
+  Connection* conn = (Connection*) ptr;
+  conn->raw_read_callback();
+}
+
+void timer_cb(void *ptr) {
   Connection* conn = (Connection*) ptr;
   conn->timer_callback();
 }
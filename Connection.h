@@ -2,22 +2,27 @@
 #ifndef CONNECTION_H
 #define CONNECTION_H
 
+#include <deque>
 #include <queue>
 #include <string>
 #include <fstream>
 #include <map>
 #include <unordered_map>
 
+#include <event2/buffer.h>
 #include <event2/bufferevent.h>
 #include <event2/dns.h>
 #include <event2/event.h>
 #include <event2/util.h>
 
 #include "AdaptiveSampler.h"
+#include "Arena.h"
 #include "cmdline.h"
+#include "ConnectionContext.h"
 #include "ConnectionOptions.h"
 #include "ConnectionStats.h"
 #include "Generator.h"
+#include "IOEngine.h"
 #include "Operation.h"
 #include "util.h"
 #include "blockingconcurrentqueue.h"
@@ -29,38 +34,71 @@ using namespace moodycamel;
 void bev_event_cb(struct bufferevent *bev, short events, void *ptr);
 void bev_read_cb(struct bufferevent *bev, void *ptr);
 void bev_write_cb(struct bufferevent *bev, void *ptr);
-void timer_cb(evutil_socket_t fd, short what, void *ptr);
+void output_cb(struct evbuffer *buf, const struct evbuffer_cb_info *info,
+               void *ptr);
+void raw_read_cb(evutil_socket_t fd, short what, void *ptr);
+void timer_cb(void *ptr);
 
 class Protocol;
 
+// Requests in flight by opaque, and --wire_timestamps/--kernel_timestamps
+// stream offsets; in the thread's arena with --hugepages.
+typedef std::unordered_map<uint32_t, Operation, std::hash<uint32_t>,
+                           std::equal_to<uint32_t>,
+                           ArenaAllocator< std::pair<const uint32_t, Operation> > >
+  op_map;
+typedef std::deque< std::pair<uint64_t,uint32_t>,
+                    ArenaAllocator< std::pair<uint64_t,uint32_t> > > tx_queue;
+
 class Connection {
+  uint32_t cid; // Ahead of stats, which are keyed by it.
+
 public:
   Connection(struct event_base* _base, struct evdns_base* _evdns,
-             string _hostname, string _port, options_t options,
-             ConcurrentQueue<string> *a_trace_queue,
-             bool sampling = true);
+             string _hostname, string _port, ConnectionContext *context,
+             ConcurrentQueue<string> *a_trace_queue, IOEngine *engine);
   ~Connection();
 
+  // From the calling thread's Arena, if it has one.
+  static void *operator new(size_t size);
+  static void operator delete(void *p, size_t size);
+
   int do_connect();
+  void abort_connect();
+
+  ConnectionContext *context; // Shared with the thread's other connections.
+  options_t &options;
+  ConnectionStats &stats;
 
   double start_time; // Time when this connection began operations.
-  ConnectionStats stats;
-  options_t options;
+  int *finished_count; // Bumped once when check_exit_condition() first holds.
+  // Called when a do_connect() attempt turns out to succeed or fail.
+  void (*connect_cb)(Connection *conn, bool connected, void *arg);
+  void *connect_arg;
+
+  string server() const { return hostname + ":" + port; }
+  int incoming_cpu();
+  uint32_t id() const { return cid; }
 
   bool is_ready() { return read_state == IDLE; }
+  bool is_drained() { return op_queue.size() == 0; }
+  size_t outstanding() { return op_queue.size(); }
   void set_priority(int pri);
 
   // state commands
-  void start() { drive_write_machine(); }
+  void start() { finished = false; drive_write_machine(); }
   void start_loading();
   void reset();
   bool check_exit_condition(double now = 0.0);
+  size_t footprint();
 
   // event callbacks
   void event_callback(short events);
   void read_callback();
   void write_callback();
   void timer_callback();
+  void output_callback(const struct evbuffer_cb_info *info);
+  void raw_read_callback();
 
 private:
   string hostname;
@@ -69,12 +107,25 @@ private:
   struct event_base *base;
   struct evdns_base *evdns;
   struct bufferevent *bev;
+  IOEngine *engine;    // Moves bev's bytes once connected, if it wants to.
 
-  struct event *timer; // Used to control inter-transmission time.
+  wheel_timer timer;   // Used to control inter-transmission time.
   double next_time;    // Inter-transmission time parameters.
   double last_rx;      // Used to moderate transmission rate.
   double last_tx;
 
+  // --wire_timestamps: byte offset in the output stream at which each
+  // request ends, and how many bytes libevent has written so far.
+  // Allocated only with the option, as an empty deque is not small.
+  tx_queue *tx_pending;
+  uint64_t tx_flushed;
+
+  // --kernel_timestamps: reads bypass the bufferevent so that recvmsg()
+  // can collect SCM_TIMESTAMPING control messages.
+  struct event *rx_event;
+  tx_queue *ktx_pending;
+  double last_krx;     // RX timestamp of the current read batch, or 0.
+
   enum read_state_enum {
     INIT_READ,
     CONN_SETUP,
@@ -97,33 +148,15 @@ private:
   read_state_enum read_state;
   write_state_enum write_state;
 
-  //need to keep value length for read key
-  map<string,string> key_len;
   // Parameters to track progress of the data loader.
   int loader_issued, loader_completed;
 
-  //was the last op a miss
-  char last_key[256];
-  int last_miss;
-
-  uint32_t cid;
   int eof;
-
-  //trace format variables
-  double r_time; // time in seconds
-  int r_appid; // prefix minus ':' char
-  int r_type;  //1 = get, 2 = set
-  int r_ksize; //key size
-  int r_vsize; //-1 or size of value if hit
-  int r_key; //op->key as int
-  int r_hit; //1 if hit, 0 if miss
+  uint64_t issued_queries; // Since reset(), for --queries; stats are shared.
+  bool finished; // check_exit_condition() has held since the last reset().
 
   Protocol *prot;
-  Generator *valuesize;
-  Generator *keysize;
-  KeyGenerator *keygen;
-  Generator *iagen;
-  std::unordered_map<uint32_t,Operation> op_queue;
+  op_map op_queue;
 
   ConcurrentQueue<string> *trace_queue;
 
@@ -133,11 +166,19 @@ private:
   //void finish_op(Operation *op);
   void finish_op(Operation *op,int was_hit);
   void finish_op_miss(Operation *op,int was_hit);
+  void record_op(Operation *op, int was_hit);
   void issue_something(double now = 0.0);
   int issue_something_trace(double now = 0.0);
   void issue_getset(double now = 0.0);
   int issue_getsetorset(double now = 0.0);
   void drive_write_machine(double now = 0.0);
+  bool exit_condition(double now);
+  void track_tx(uint32_t opaque);
+  void mark_tx(double now);
+  void enable_busy_poll(int fd);
+  void enable_kernel_timestamps(int fd);
+  void drain_errqueue(int fd);
+  void mark_ktx(uint32_t last_byte, double ts);
 
   // request functions
   void issue_sasl();
@@ -0,0 +1,96 @@
+/* -*- c++ -*- */
+#ifndef CONNECTIONCONTEXT_H
+#define CONNECTIONCONTEXT_H
+
+#include <map>
+#include <string>
+
+#include "ConnectionOptions.h"
+#include "ConnectionStats.h"
+#include "Generator.h"
+#include "log.h"
+#include "TimerWheel.h"
+
+// What all of a thread's connections have in common, so that a
+// Connection itself holds little more than its socket, outstanding
+// requests and schedule: the options, the key, value size and
+// inter-arrival generators (which keep no per-connection state), the
+// timer wheel that paces requests and the stats that connections
+// record into.  Stats are kept per server, or per connection with
+// --connection_stats, keyed as in server_stats.
+class ConnectionContext {
+public:
+  ConnectionContext(const options_t &_options, struct event_base *base,
+                    bool _sampling = true) :
+    options(_options), sampling(_sampling), window_start(0), iagen(NULL),
+    wheel(new TimerWheel(base)), interval(NULL) {
+    valuesize = createGenerator(options.valuesize);
+    keysize = createGenerator(options.keysize);
+    keygen = new KeyGenerator(keysize, options.records);
+    set_lambda(options.lambda);
+  }
+
+  ~ConnectionContext() {
+    delete interval;
+    delete wheel;
+    delete iagen;
+    delete keygen;
+    delete keysize;
+    delete valuesize;
+  }
+
+  options_t options;
+  bool sampling;
+
+  // Start of the current stats window, on Operation::start_time's
+  // clock.  Requests issued earlier are not recorded when they finish.
+  double window_start;
+
+  Generator *valuesize;
+  Generator *keysize;
+  KeyGenerator *keygen;
+  Generator *iagen;
+
+  TimerWheel *wheel;
+
+  std::map<std::string, ConnectionStats> stats;
+
+  // With --profile, gets and sets are also recorded here, for the
+  // latency of each step of the profile.  NULL otherwise.
+  ConnectionStats *interval;
+
+  // A std::map, so the reference stays valid until its entry is erased.
+  ConnectionStats &stats_for(const std::string &key) {
+    auto i = stats.find(key);
+    if (i == stats.end())
+      i = stats.insert(std::make_pair(key, ConnectionStats(sampling,
+                                                           options.hotkeys))).first;
+    return i->second;
+  }
+
+  void reset_stats() {
+    for (auto &s: stats) s.second = ConnectionStats(sampling, options.hotkeys);
+  }
+
+  // Change the per-connection request rate, e.g. between steps of
+  // --scan or along --profile.  Running connections draw their next
+  // inter-arrival time from the new generator.
+  void set_lambda(double lambda) {
+    options.lambda = lambda;
+    delete iagen;
+
+    if (options.lambda <= 0) {
+      iagen = createGenerator("0");
+    } else {
+      D("iagen = createGenerator(%s)", options.ia);
+      iagen = createGenerator(options.ia);
+      iagen->set_lambda(options.lambda);
+    }
+  }
+
+private:
+  ConnectionContext(const ConnectionContext &) = delete;
+  ConnectionContext &operator=(const ConnectionContext &) = delete;
+};
+
+#endif // CONNECTIONCONTEXT_H
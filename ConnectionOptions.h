@@ -55,6 +55,13 @@ typedef struct {
   bool oob_thread;
 
   bool moderate;
+
+  int hotkeys;
+  bool wire_timestamps;
+  bool kernel_timestamps;
+  char engine[16];
+  int busy_poll;
+  int so_busy_poll;
 } options_t;
 
 #endif // CONNECTIONOPTIONS_H
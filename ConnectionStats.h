@@ -14,39 +14,60 @@
 #include "LogHistogramSampler.h"
 #endif
 #include "AgentStats.h"
+#include "HotKeySampler.h"
 #include "Operation.h"
 
 using namespace std;
 
 class ConnectionStats {
  public:
- ConnectionStats(bool _sampling = true) :
+ ConnectionStats(bool _sampling = true, int _hotkeys = 0) :
 #ifdef USE_ADAPTIVE_SAMPLER
    get_sampler(100000), set_sampler(100000), access_sampler(100000), op_sampler(100000),
+   txwait_sampler(100000), wire_sampler(100000),
+   kclient_sampler(100000), knet_sampler(100000),
 #elif defined(USE_HISTOGRAM_SAMPLER)
    get_sampler(10000,1), set_sampler(10000,1), access_sampler(10000,1), op_sampler(1000,1),
+   txwait_sampler(10000,1), wire_sampler(10000,1),
+   kclient_sampler(10000,1), knet_sampler(10000,1),
 #else
    get_sampler(200), set_sampler(200), access_sampler(200), op_sampler(100),
+   txwait_sampler(200), wire_sampler(200),
+   kclient_sampler(200), knet_sampler(200),
 #endif
    rx_bytes(0), tx_bytes(0), gets(0), sets(0), accesses(0),
    get_misses(0), window_gets(0), window_sets(0), window_accesses(0),
-   window_get_misses(0), skips(0), sampling(_sampling) {}
+   window_get_misses(0), skips(0), sampling(_sampling), lag_sampler(200),
+   lag_max(0),
+   hot_ops(_hotkeys), hot_bytes(_hotkeys, true) {}
 
 #ifdef USE_ADAPTIVE_SAMPLER
   AdaptiveSampler<Operation> get_sampler;
   AdaptiveSampler<Operation> set_sampler;
   AdaptiveSampler<Operation> access_sampler;
   AdaptiveSampler<double> op_sampler;
+  AdaptiveSampler<double> txwait_sampler;
+  AdaptiveSampler<double> wire_sampler;
+  AdaptiveSampler<double> kclient_sampler;
+  AdaptiveSampler<double> knet_sampler;
 #elif defined(USE_HISTOGRAM_SAMPLER)
   HistogramSampler get_sampler;
   HistogramSampler set_sampler;
   HistogramSampler access_sampler;
   HistogramSampler op_sampler;
+  HistogramSampler txwait_sampler;
+  HistogramSampler wire_sampler;
+  HistogramSampler kclient_sampler;
+  HistogramSampler knet_sampler;
 #else
   LogHistogramSampler get_sampler;
   LogHistogramSampler set_sampler;
   LogHistogramSampler access_sampler;
   LogHistogramSampler op_sampler;
+  LogHistogramSampler txwait_sampler;  // Issue until flushed to the kernel.
+  LogHistogramSampler wire_sampler;    // Flushed until response parsed.
+  LogHistogramSampler kclient_sampler; // Latency minus knet: loop + stack.
+  LogHistogramSampler knet_sampler;    // Kernel TX until kernel RX.
 #endif
 
   uint64_t rx_bytes, tx_bytes;
@@ -58,11 +79,40 @@ class ConnectionStats {
 
   bool sampling;
 
+  // Event loop lag: how late timers and reads ran relative to when they
+  // were due.  Always recorded, since it says whether to trust the rest.
+  LogHistogramSampler lag_sampler;
+  double lag_max;  // Worst event loop lag, in us.
+
+  HotKeySampler hot_ops;    // Top keys by number of accesses.
+  HotKeySampler hot_bytes;  // Top keys by bytes moved.
+
   void log_get(Operation& op) { if (sampling) get_sampler.sample(op); window_gets++; gets++; }
   void log_set(Operation& op) { if (sampling) set_sampler.sample(op); window_sets++; sets++; }
   void log_access(Operation& op) { //if (sampling) access_sampler.sample(op); 
       window_accesses++; accesses++; }
   void log_op (double op)     { if (sampling)  op_sampler.sample(op); }
+  void log_wire(Operation& op) {
+    if (!sampling || op.send_time == 0.0) return;
+    txwait_sampler.sample(op.tx_wait());
+    wire_sampler.sample(op.wire_time());
+  }
+  void log_kernel(Operation& op) {
+    if (!sampling || op.ktx_time == 0.0 || op.krx_time < op.ktx_time ||
+        op.time() < op.kernel_time()) return;
+    kclient_sampler.sample(op.time() - op.kernel_time());
+    knet_sampler.sample(op.kernel_time());
+  }
+  void log_lag(double us) {
+    lag_sampler.sample(us < 1.0 ? 1.0 : us);
+    if (us > lag_max) lag_max = us;
+  }
+  void log_key(Operation& op, bool miss) {
+    if (!hot_ops.enabled()) return;
+    uint64_t bytes = op.key.length() + op.valuelen;
+    hot_ops.sample(op, bytes, miss);
+    hot_bytes.sample(op, bytes, miss);
+  }
 
   double get_qps() {
     return (gets + sets) / (stop - start);
@@ -103,12 +153,24 @@ class ConnectionStats {
     for (auto i: cs.set_sampler.samples) set_sampler.sample(i); //log_set(i);
     for (auto i: cs.access_sampler.samples) access_sampler.sample(i); //log_access(i);
     for (auto i: cs.op_sampler.samples)  op_sampler.sample(i); //log_op(i);
+    for (auto i: cs.txwait_sampler.samples) txwait_sampler.sample(i);
+    for (auto i: cs.wire_sampler.samples) wire_sampler.sample(i);
+    for (auto i: cs.kclient_sampler.samples) kclient_sampler.sample(i);
+    for (auto i: cs.knet_sampler.samples) knet_sampler.sample(i);
 #else
     get_sampler.accumulate(cs.get_sampler);
     set_sampler.accumulate(cs.set_sampler);
     access_sampler.accumulate(cs.access_sampler);
     op_sampler.accumulate(cs.op_sampler);
+    txwait_sampler.accumulate(cs.txwait_sampler);
+    wire_sampler.accumulate(cs.wire_sampler);
+    kclient_sampler.accumulate(cs.kclient_sampler);
+    knet_sampler.accumulate(cs.knet_sampler);
 #endif
+    lag_sampler.accumulate(cs.lag_sampler);
+    if (cs.lag_max > lag_max) lag_max = cs.lag_max;
+    hot_ops.accumulate(cs.hot_ops);
+    hot_bytes.accumulate(cs.hot_bytes);
 
     rx_bytes += cs.rx_bytes;
     tx_bytes += cs.tx_bytes;
@@ -141,6 +203,31 @@ class ConnectionStats {
            "50th", "90th", "95th", "99th", "99.9th");
   }
 
+  static void print_hotkeys(const char *tag, const HotKeySampler &sampler,
+                            size_t k) {
+    printf("%-30s %10s %12s %7s %7s %7s %7s %7s\n", tag,
+           "ops", "bytes", "miss%", "avg", "50th", "99th", "99.9th");
+
+    for (auto e: sampler.top(k)) {
+      printf("%-30.30s %10" PRIu64 " %12" PRIu64 " %7.1f %7.1f %7.1f %7.1f %7.1f\n",
+             e.key.c_str(), e.ops, e.bytes,
+             e.ops ? (double) e.misses / e.ops * 100 : 0.0,
+             e.latency.average(), e.latency.get_nth(50),
+             e.latency.get_nth(99), e.latency.get_nth(99.9));
+    }
+  }
+
+  // Dump the tracked keys as "<tag> key ops bytes misses avg 50th 99th".
+  static void save_hotkeys(FILE *file, const char *tag,
+                           const HotKeySampler &sampler, size_t k) {
+    for (auto e: sampler.top(k)) {
+      fprintf(file, "%s %s %" PRIu64 " %" PRIu64 " %" PRIu64 " %f %f %f\n",
+              tag, e.key.c_str(), e.ops, e.bytes, e.misses,
+              e.latency.average(), e.latency.get_nth(50),
+              e.latency.get_nth(99));
+    }
+  }
+
 #ifdef USE_ADAPTIVE_SAMPLER
   void print_stats(const char *tag, AdaptiveSampler<Operation> &sampler,
                    bool newline = true) {
@@ -0,0 +1,239 @@
+#ifdef __linux__
+
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "Connection.h"
+#include "EpollEngine.h"
+#include "log.h"
+#include "util.h"
+
+struct epoll_conn {
+  EpollEngine *engine;
+  Connection *conn;
+  struct bufferevent *bev;
+  int fd;
+  struct evbuffer_cb_entry *cb;
+  bool queued;   // On the engine's send_queue.
+  bool blocked;  // Last write hit EAGAIN; wait for EPOLLOUT.
+  bool closed;   // EOF or error seen; no more I/O.
+};
+
+static void epoll_output_cb(struct evbuffer *buf,
+                            const struct evbuffer_cb_info *info, void *ptr);
+static void epoll_ready_cb(evutil_socket_t fd, short what, void *ptr);
+
+EpollEngine::EpollEngine(struct event_base *base, const options_t &options) :
+  idle_since(0.0)
+{
+  ep_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (ep_fd < 0) DIE("epoll_create1(): %s", strerror(errno));
+
+  busy_poll = options.blocking ? 0.0 : options.busy_poll / 1000000.0;
+  ep_event = event_new(base, ep_fd, EV_READ | EV_PERSIST, epoll_ready_cb,
+                       this);
+}
+
+EpollEngine::~EpollEngine() {
+  while (conns.size() > 0) detach(conns.begin()->first);
+  event_free(ep_event);
+  close(ep_fd);
+}
+
+/**
+ * Take the socket over: the bufferevent keeps its buffers but stops
+ * reading and writing, and the socket joins our epoll set.
+ */
+bool EpollEngine::attach(Connection *conn, struct bufferevent *bev) {
+  epoll_conn *ec = new epoll_conn();
+
+  ec->engine = this;
+  ec->conn = conn;
+  ec->bev = bev;
+  ec->fd = bufferevent_getfd(bev);
+  ec->queued = ec->blocked = ec->closed = false;
+
+  bufferevent_disable(bev, EV_READ | EV_WRITE);
+  ec->cb = evbuffer_add_cb(bufferevent_get_output(bev), epoll_output_cb, ec);
+  conns[conn] = ec;
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+  ev.data.ptr = ec;
+  if (epoll_ctl(ep_fd, EPOLL_CTL_ADD, ec->fd, &ev) < 0)
+    DIE("epoll_ctl(): %s", strerror(errno));
+
+  return true;
+}
+
+void EpollEngine::detach(Connection *conn) {
+  auto it = conns.find(conn);
+  if (it == conns.end()) return;
+
+  epoll_conn *ec = it->second;
+  conns.erase(it);
+
+  if (!ec->closed) epoll_ctl(ep_fd, EPOLL_CTL_DEL, ec->fd, NULL);
+  evbuffer_remove_cb_entry(bufferevent_get_output(ec->bev), ec->cb);
+  if (ec->queued)
+    send_queue.erase(std::remove(send_queue.begin(), send_queue.end(), ec),
+                     send_queue.end());
+  delete ec;
+}
+
+void EpollEngine::queue(epoll_conn *ec) {
+  if (ec->queued) return;
+  ec->queued = true;
+  send_queue.push_back(ec);
+}
+
+/**
+ * Spin: poll the sockets and run due timers without blocking.  Block
+ * in libevent only once busy_poll has passed without socket traffic.
+ */
+void EpollEngine::loop(struct event_base *base, int flags) {
+  int n = poll();
+  event_base_loop(base, EVLOOP_NONBLOCK);
+  flush();
+
+  if (n > 0 || busy_poll < 0) {
+    idle_since = 0.0;
+    return;
+  }
+
+  double now = get_time();
+  if (idle_since == 0.0) idle_since = now;
+  if (now - idle_since < busy_poll) return;
+
+  event_add(ep_event, NULL);
+  event_base_loop(base, EVLOOP_ONCE);
+  event_del(ep_event);
+  flush();
+  idle_since = 0.0;
+}
+
+/**
+ * Handle every ready socket once; returns how many there were.
+ */
+int EpollEngine::poll() {
+  struct epoll_event events[EPOLL_EVENTS];
+
+  int n = epoll_wait(ep_fd, events, EPOLL_EVENTS, 0);
+  if (n < 0) {
+    if (errno == EINTR) return 0;
+    DIE("epoll_wait(): %s", strerror(errno));
+  }
+
+  for (int i = 0; i < n; i++) {
+    epoll_conn *ec = (epoll_conn *) events[i].data.ptr;
+    if (ec->closed) continue;
+
+    if (events[i].events & EPOLLERR) {
+      int err = 0;
+      socklen_t len = sizeof(err);
+      getsockopt(ec->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+      errno = err;
+      ec->closed = true;
+      epoll_ctl(ep_fd, EPOLL_CTL_DEL, ec->fd, NULL);
+      ec->conn->event_callback(BEV_EVENT_ERROR);
+      continue;
+    }
+
+    if (events[i].events & EPOLLOUT && ec->blocked) {
+      ec->blocked = false;
+      queue(ec);
+    }
+
+    if (events[i].events & (EPOLLIN | EPOLLHUP)) do_read(ec);
+  }
+
+  flush();
+  return n;
+}
+
+/**
+ * Edge-triggered: read until the socket is drained, straight into the
+ * input evbuffer, then let the Connection parse everything at once.
+ */
+void EpollEngine::do_read(epoll_conn *ec) {
+  struct evbuffer *input = bufferevent_get_input(ec->bev);
+  size_t got = 0;
+
+  while (1) {
+    struct evbuffer_iovec v;
+    if (evbuffer_reserve_space(input, EPOLL_READ, &v, 1) < 1)
+      DIE("evbuffer_reserve_space() failed");
+
+    ssize_t r = recv(ec->fd, v.iov_base, v.iov_len, 0);
+    if (r > 0) {
+      v.iov_len = r;
+      evbuffer_commit_space(input, &v, 1);
+      got += r;
+      // A short read drained the socket; new data raises a new edge.
+      if ((size_t) r < EPOLL_READ) break;
+      continue;
+    }
+
+    evbuffer_commit_space(input, NULL, 0);
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    if (r < 0 && errno == EINTR) continue;
+
+    ec->closed = true;
+    epoll_ctl(ep_fd, EPOLL_CTL_DEL, ec->fd, NULL);
+    if (got > 0) ec->conn->read_callback();
+    ec->conn->event_callback(r == 0 ? BEV_EVENT_EOF : BEV_EVENT_ERROR);
+    return;
+  }
+
+  if (got > 0) ec->conn->read_callback();
+}
+
+/**
+ * Write as much queued output as the socket takes.  evbuffer_write()
+ * drains what was sent, which is what --wire_timestamps sees.
+ */
+void EpollEngine::do_write(epoll_conn *ec) {
+  struct evbuffer *output = bufferevent_get_output(ec->bev);
+
+  while (evbuffer_get_length(output) > 0) {
+    if (evbuffer_write(output, ec->fd) >= 0) continue;
+    if (errno == EINTR) continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      ec->blocked = true;
+      return;
+    }
+
+    ec->closed = true;
+    epoll_ctl(ep_fd, EPOLL_CTL_DEL, ec->fd, NULL);
+    ec->conn->event_callback(BEV_EVENT_ERROR);
+    return;
+  }
+}
+
+void EpollEngine::flush() {
+  std::vector<epoll_conn*> q;
+  q.swap(send_queue);
+
+  for (epoll_conn *ec: q) {
+    ec->queued = false;
+    if (!ec->closed && !ec->blocked) do_write(ec);
+  }
+}
+
+/* The follow are C trampolines for libevent callbacks. */
+static void epoll_output_cb(struct evbuffer *buf,
+                            const struct evbuffer_cb_info *info, void *ptr) {
+  epoll_conn *ec = (epoll_conn *) ptr;
+  if (info->n_added > 0) ec->engine->queue(ec);
+}
+
+static void epoll_ready_cb(evutil_socket_t fd, short what, void *ptr) {
+  ((EpollEngine *) ptr)->poll();
+}
+
+#endif // __linux__
@@ -0,0 +1,51 @@
+/* -*- c++ -*- */
+#ifndef EPOLLENGINE_H
+#define EPOLLENGINE_H
+
+#include <unordered_map>
+#include <vector>
+
+#include <event2/buffer.h>
+
+#include "IOEngine.h"
+
+#define EPOLL_EVENTS 256
+#define EPOLL_READ   16384  // Bytes reserved in the input per recv().
+
+struct epoll_conn; // Per-connection state, see EpollEngine.cc.
+
+// Busy-polling engine for latency measurement.  Sockets live in a
+// private edge-triggered epoll set that loop() polls without blocking,
+// reading straight into space reserved in each connection's input
+// evbuffer and writing queued output at the end of every pass.  Timers
+// still run through libevent, non-blocking, between polls.  Only after
+// --busy_poll microseconds without socket traffic does loop() block in
+// libevent, with the epoll fd registered so that traffic wakes it.
+class EpollEngine : public IOEngine {
+public:
+  EpollEngine(struct event_base *base, const options_t &options);
+  ~EpollEngine();
+
+  bool attach(Connection *conn, struct bufferevent *bev);
+  void detach(Connection *conn);
+  void loop(struct event_base *base, int flags);
+
+  // Called from the libevent callbacks in EpollEngine.cc.
+  int poll();
+  void queue(epoll_conn *ec);
+
+private:
+  struct event *ep_event;  // Epoll fd readable, added only while blocked.
+  int ep_fd;
+  double busy_poll;        // Seconds to spin before blocking; < 0 never.
+  double idle_since;       // When the current run of empty polls began.
+
+  std::unordered_map<Connection*,epoll_conn*> conns;
+  std::vector<epoll_conn*> send_queue; // Connections with output to send.
+
+  void flush();
+  void do_read(epoll_conn *ec);
+  void do_write(epoll_conn *ec);
+};
+
+#endif // EPOLLENGINE_H
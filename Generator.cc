@@ -54,10 +54,15 @@ Generator* createGenerator(std::string str) {
 
   char t = t_ptr[0];
 
-  saveptr = NULL;
-  char *s1 = strtok_r(a_ptr, ",", &saveptr);
-  char *s2 = strtok_r(NULL, ",", &saveptr);
-  char *s3 = strtok_r(NULL, ",", &saveptr);
+  // Bare names like "exponential" have no arguments (the rate comes
+  // from set_lambda()); strtok_r() must not start on a NULL string.
+  char *s1 = NULL, *s2 = NULL, *s3 = NULL;
+  if (a_ptr) {
+    saveptr = NULL;
+    s1 = strtok_r(a_ptr, ",", &saveptr);
+    s2 = strtok_r(NULL, ",", &saveptr);
+    s3 = strtok_r(NULL, ",", &saveptr);
+  }
 
   double a1 = s1 ? atof(s1) : 0.0;
   double a2 = s2 ? atof(s2) : 0.0;
@@ -0,0 +1,191 @@
+/* -*- c++ -*- */
+#ifndef HOTKEYSAMPLER_H
+#define HOTKEYSAMPLER_H
+
+// Space-Saving sketch (Metwally et al., ICDT 2005) that tracks the
+// heaviest keys seen by a connection.  Weight is either one per
+// access or the number of bytes moved for the access.  Every tracked
+// key also carries its own small latency histogram and miss count, so
+// the tail of a hot key can be compared against the aggregate.
+//
+// Counters live in a min-heap keyed by weight, so each sample is
+// O(log capacity) and evicting the lightest key is O(1) to find.
+
+#include <inttypes.h>
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "LogHistogramSampler.h"
+#include "Operation.h"
+
+// 1.1^150 us ~= 1.6s, enough range for per-key tails.
+#define HOTKEY_BINS 150
+
+// Track this many counters per reported key to tighten the error bound.
+#define HOTKEY_OVERSAMPLE 4
+
+class HotKeySampler {
+public:
+  struct Entry {
+    std::string key;
+    uint64_t weight;  // Estimated weight (upper bound).
+    uint64_t error;   // Weight inherited from the evicted key.
+    uint64_t ops, bytes, misses;
+    LogHistogramSampler latency;
+
+    Entry() : weight(0), error(0), ops(0), bytes(0), misses(0),
+              latency(HOTKEY_BINS) {}
+  };
+
+  std::vector<Entry> entries;
+  std::unordered_map<std::string, size_t> index;
+  size_t capacity;
+  bool by_bytes;
+
+  HotKeySampler(int k = 0, bool _by_bytes = false) :
+    capacity(k * HOTKEY_OVERSAMPLE), by_bytes(_by_bytes) {}
+
+  bool enabled() const { return capacity > 0; }
+
+  void sample(const Operation &op, uint64_t bytes, bool miss) {
+    if (!enabled()) return;
+
+    size_t i;
+    bool fresh = false;
+    auto it = index.find(op.key);
+
+    if (it != index.end()) {
+      i = it->second;
+    } else if (entries.size() < capacity) {
+      i = entries.size();
+      entries.push_back(Entry());
+      entries[i].key = op.key;
+      index[op.key] = i;
+      fresh = true;
+    } else {
+      // Replace the lightest counter; the new key inherits its weight.
+      i = 0;
+      Entry &e = entries[0];
+      index.erase(e.key);
+      e.key = op.key;
+      e.error = e.weight;
+      e.ops = e.bytes = e.misses = 0;
+      std::fill(e.latency.bins.begin(), e.latency.bins.end(), 0);
+      e.latency.sum = e.latency.sum_sq = 0.0;
+      index[op.key] = 0;
+    }
+
+    Entry &e = entries[i];
+    e.weight += by_bytes ? bytes : 1;
+    e.ops++;
+    e.bytes += bytes;
+    if (miss) e.misses++;
+    e.latency.sample(op.time());
+
+    if (fresh) sift_up(i);
+    else sift_down(i);
+  }
+
+  // Merge another sketch into this one (Agarwal et al., "Mergeable
+  // Summaries").  Keys present in both are summed.  A key missing from
+  // a full sketch may have weighed up to that sketch's minimum there,
+  // so it gains that minimum as both weight and error.  Then only the
+  // heaviest `capacity` counters are kept.
+  void accumulate(const HotKeySampler &h) {
+    if (!h.enabled()) return;
+    if (!enabled()) {
+      capacity = h.capacity;
+      by_bytes = h.by_bytes;
+    }
+
+    uint64_t min_this = min_weight(), min_h = h.min_weight();
+
+    std::vector<Entry> merged = entries;
+    std::unordered_map<std::string, size_t> merged_index = index;
+
+    for (auto &e: merged) {
+      if (h.index.count(e.key)) continue;
+      e.weight += min_h;
+      e.error += min_h;
+    }
+
+    for (auto &o: h.entries) {
+      auto it = merged_index.find(o.key);
+      if (it == merged_index.end()) {
+        merged_index[o.key] = merged.size();
+        merged.push_back(o);
+        merged.back().weight += min_this;
+        merged.back().error += min_this;
+      } else {
+        Entry &e = merged[it->second];
+        e.weight += o.weight;
+        e.error += o.error;
+        e.ops += o.ops;
+        e.bytes += o.bytes;
+        e.misses += o.misses;
+        e.latency.accumulate(o.latency);
+      }
+    }
+
+    entries = top(merged, capacity);
+    std::reverse(entries.begin(), entries.end()); // Ascending is a heap.
+    index.clear();
+    for (size_t i = 0; i < entries.size(); i++) index[entries[i].key] = i;
+  }
+
+  // The k heaviest keys, heaviest first.
+  std::vector<Entry> top(size_t k) const { return top(entries, k); }
+
+private:
+  // What an untracked key may have weighed: 0 until the sketch fills.
+  uint64_t min_weight() const {
+    if (entries.size() < capacity || entries.size() == 0) return 0;
+    uint64_t m = entries[0].weight;
+    for (auto &e: entries) m = std::min(m, e.weight);
+    return m;
+  }
+
+  static std::vector<Entry> top(std::vector<Entry> v, size_t k) {
+    std::sort(v.begin(), v.end(), [](const Entry &a, const Entry &b) {
+        return a.weight > b.weight;
+      });
+    if (v.size() > k) v.resize(k);
+    return v;
+  }
+
+  void swap_entries(size_t a, size_t b) {
+    std::swap(entries[a], entries[b]);
+    index[entries[a].key] = a;
+    index[entries[b].key] = b;
+  }
+
+  // New counters start at a leaf and may be lighter than their parent.
+  void sift_up(size_t i) {
+    while (i > 0) {
+      size_t p = (i - 1) / 2;
+      if (entries[p].weight <= entries[i].weight) return;
+      swap_entries(i, p);
+      i = p;
+    }
+  }
+
+  // Existing weights only ever grow, so restoring the heap only needs
+  // to push the updated counter toward the leaves.
+  void sift_down(size_t i) {
+    size_t n = entries.size();
+
+    while (true) {
+      size_t l = 2 * i + 1, r = l + 1, min = i;
+      if (l < n && entries[l].weight < entries[min].weight) min = l;
+      if (r < n && entries[r].weight < entries[min].weight) min = r;
+      if (min == i) return;
+      swap_entries(i, min);
+      i = min;
+    }
+  }
+};
+
+#endif // HOTKEYSAMPLER_H
@@ -0,0 +1,32 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+#include "EpollEngine.h"
+#include "IOEngine.h"
+#include "log.h"
+
+#ifdef HAVE_DECL_IORING_REGISTER_PBUF_RING
+#include "UringEngine.h"
+#endif
+
+IOEngine *IOEngine::create(const options_t &options, struct event_base *base) {
+  const char *name = options.engine;
+
+  if (!strcmp(name, "libevent")) return new LibeventEngine();
+#ifdef __linux__
+  if (!strcmp(name, "epoll")) return new EpollEngine(base, options);
+#else
+  if (!strcmp(name, "epoll")) DIE("--engine=epoll: epoll is Linux-only");
+#endif
+
+#ifdef HAVE_DECL_IORING_REGISTER_PBUF_RING
+  if (!strcmp(name, "uring")) return new UringEngine(base);
+#else
+  if (!strcmp(name, "uring"))
+    DIE("--engine=uring: built without io_uring provided buffer rings");
+#endif
+
+  DIE("Unknown --engine: %s", name);
+}
@@ -0,0 +1,45 @@
+/* -*- c++ -*- */
+#ifndef IOENGINE_H
+#define IOENGINE_H
+
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include "ConnectionOptions.h"
+
+class Connection;
+
+// Moves bytes between a Connection's socket and its bufferevent's
+// input/output evbuffers.  Protocol and Connection code only ever
+// touch those evbuffers, so once a connection is established an
+// engine can take its socket over without the rest of the client
+// noticing.  One engine per do_mutilate() thread.
+class IOEngine {
+public:
+  virtual ~IOEngine() {}
+
+  // Called once the connection is established.  Return false to leave
+  // the I/O to the bufferevent.
+  virtual bool attach(Connection *conn, struct bufferevent *bev) = 0;
+
+  // Called before the connection's bufferevent is freed.
+  virtual void detach(Connection *conn) = 0;
+
+  // One pass of do_mutilate()'s event loop.  Engines that poll their
+  // sockets themselves decide here when to spin and when to block.
+  virtual void loop(struct event_base *base, int flags) {
+    event_base_loop(base, flags);
+  }
+
+  // Engine for options.engine; DIEs on an unknown or unsupported name.
+  static IOEngine *create(const options_t &options, struct event_base *base);
+};
+
+// The default: bufferevents read and write their sockets themselves.
+class LibeventEngine : public IOEngine {
+public:
+  bool attach(Connection *conn, struct bufferevent *bev) { return false; }
+  void detach(Connection *conn) {}
+};
+
+#endif // IOENGINE_H
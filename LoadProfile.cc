@@ -0,0 +1,121 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "LoadProfile.h"
+#include "log.h"
+
+using namespace std;
+
+static vector<string> split(const string &s, char sep) {
+  vector<string> parts;
+  size_t from = 0;
+
+  while (1) {
+    size_t to = s.find(sep, from);
+    parts.push_back(s.substr(from, to - from));
+    if (to == string::npos) break;
+    from = to + 1;
+  }
+
+  return parts;
+}
+
+static double positive(const string &s, const string &spec) {
+  char *end;
+  double v = strtod(s.c_str(), &end);
+  if (s.empty() || *end) DIE("--profile %s: bad number '%s'", spec.c_str(),
+                             s.c_str());
+  if (v <= 0) DIE("--profile %s: rates must be positive", spec.c_str());
+  return v;
+}
+
+LoadProfile::LoadProfile(const string &spec, int _time) : time(_time) {
+  size_t colon = spec.find(':');
+  string type = spec.substr(0, colon);
+  string rest = colon == string::npos ? "" : spec.substr(colon + 1);
+  vector<string> fields = split(rest, ':');
+
+  canonical = spec;
+
+  if (type == "ramp" && fields.size() == 2) {
+    kind = RAMP;
+    for (auto &f: fields) params.push_back(positive(f, spec));
+  } else if (type == "step" && rest.size()) {
+    kind = STEP;
+    for (auto &f: split(rest, ',')) params.push_back(positive(f, spec));
+  } else if (type == "sine" && fields.size() == 3) {
+    kind = SINE;
+    for (auto &f: fields) params.push_back(positive(f, spec));
+    if (params[1] >= params[0])
+      DIE("--profile %s: amplitude must be less than the mean", spec.c_str());
+  } else if (type == "file" && rest.size()) {
+    kind = POINTS;
+    FILE *f = fopen(rest.c_str(), "r");
+    if (f == NULL) DIE("--profile: cannot open %s", rest.c_str());
+
+    char line[256];
+    canonical = "points:";
+    while (fgets(line, sizeof(line), f)) {
+      double t, q;
+      if (line[0] == '#' || strspn(line, " \t\r\n") == strlen(line)) continue;
+      if (sscanf(line, "%lf %lf", &t, &q) != 2 || t < 0 || q <= 0)
+        DIE("--profile %s: bad line: %s", spec.c_str(), line);
+
+      char point[64];
+      snprintf(point, sizeof(point), "%s%g=%g",
+               points.size() ? "," : "", t, q);
+      canonical += point;
+      points.push_back(make_pair(t, q));
+    }
+    fclose(f);
+  } else if (type == "points" && rest.size()) {
+    kind = POINTS;
+    for (auto &p: split(rest, ',')) {
+      size_t eq = p.find('=');
+      if (eq == string::npos) DIE("--profile %s: bad point", spec.c_str());
+      points.push_back(make_pair(atof(p.substr(0, eq).c_str()),
+                                 positive(p.substr(eq + 1), spec)));
+    }
+  } else {
+    DIE("--profile %s: expected ramp:FROM:TO, step:Q1,Q2,..., "
+        "sine:MEAN:AMP:PERIOD or file:PATH", spec.c_str());
+  }
+
+  if (kind == POINTS) {
+    if (points.size() == 0) DIE("--profile %s: no points", spec.c_str());
+    stable_sort(points.begin(), points.end(),
+                [](const pair<double,double> &a, const pair<double,double> &b) {
+                  return a.first < b.first;
+                });
+  }
+}
+
+double LoadProfile::qps(double t) const {
+  if (t < 0) t = 0;
+  if (t > time) t = time;
+
+  switch (kind) {
+  case RAMP:
+    return params[0] + (params[1] - params[0]) * t / time;
+  case STEP: {
+    size_t i = (size_t) (t * params.size() / time);
+    return params[min(i, params.size() - 1)];
+  }
+  case SINE:
+    return params[0] + params[1] * sin(2 * M_PI * t / params[2]);
+  case POINTS: {
+    double q = points[0].second;
+    for (auto &p: points) {
+      if (p.first > t) break;
+      q = p.second;
+    }
+    return q;
+  }
+  }
+
+  return 0;
+}
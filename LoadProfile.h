@@ -0,0 +1,35 @@
+/* -*- c++ -*- */
+#ifndef LOADPROFILE_H
+#define LOADPROFILE_H
+
+#include <string>
+#include <vector>
+
+// Aggregate QPS target over the course of a run, for --profile.  Time
+// is in seconds from the start of measurement, over a run of `time`
+// seconds:
+//
+//   ramp:FROM:TO          linearly from FROM to TO QPS
+//   step:Q1,Q2,...        equal steps at each QPS in turn
+//   sine:MEAN:AMP:PERIOD  MEAN + AMP * sin(2 pi t / PERIOD)
+//   file:PATH             "SECONDS QPS" lines, each held until the next
+//
+// Every rate must be positive, since a lambda of 0 means unpaced.
+class LoadProfile {
+public:
+  LoadProfile(const std::string &spec, int time);
+
+  double qps(double t) const;
+
+  // The profile in a form that needs no files, for agents.
+  const std::string &spec() const { return canonical; }
+
+private:
+  enum { RAMP, STEP, SINE, POINTS } kind;
+  std::string canonical;
+  double time;
+  std::vector<double> params;  // RAMP, STEP and SINE.
+  std::vector< std::pair<double,double> > points;  // POINTS: (t, qps).
+};
+
+#endif // LOADPROFILE_H
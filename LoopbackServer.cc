@@ -0,0 +1,304 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string>
+#include <unordered_map>
+
+#include "binary_protocol.h"
+#include "log.h"
+#include "LoopbackServer.h"
+
+#define LOOPBACK_EVENTS 256
+#define LOOPBACK_READ   65536
+
+enum loopback_proto { UNKNOWN, ASCII, BINARY, RESP };
+
+struct loopback_client {
+  loopback_proto proto;
+  std::string in, out;
+  bool want_write;
+
+  loopback_client() : proto(UNKNOWN), want_write(false) {}
+};
+
+/*
+ * Answer every complete ASCII request line; returns bytes consumed.
+ */
+static size_t serve_ascii(const std::string &in, std::string &out) {
+  size_t pos = 0;
+
+  while (1) {
+    size_t eol = in.find("\r\n", pos);
+    if (eol == std::string::npos) break;
+
+    const char *line = in.c_str() + pos;
+    size_t next = eol + 2;
+
+    if (!strncmp(line, "get ", 4) || !strncmp(line, "gets ", 5)) {
+      out += "END\r\n";
+    } else if (!strncmp(line, "set ", 4) || !strncmp(line, "add ", 4) ||
+               !strncmp(line, "replace ", 8)) {
+      int bytes = 0;
+      if (sscanf(line, "%*s %*s %*d %*d %d", &bytes) != 1) bytes = 0;
+      if (in.size() < next + bytes + 2) break;
+      next += bytes + 2;
+      out += "STORED\r\n";
+    } else if (!strncmp(line, "delete ", 7)) {
+      out += "NOT_FOUND\r\n";
+    } else {
+      out += "ERROR\r\n";
+    }
+
+    pos = next;
+  }
+
+  return pos;
+}
+
+/*
+ * Answer every complete binary request; returns bytes consumed.
+ */
+static size_t serve_binary(const std::string &in, std::string &out) {
+  size_t pos = 0;
+
+  while (in.size() - pos >= 24) {
+    const binary_header_t *h = (const binary_header_t *) (in.c_str() + pos);
+    size_t len = 24 + ntohl(h->body_len);
+    if (in.size() - pos < len) break;
+
+    binary_header_t r;
+    memset(&r, 0, 24);
+    r.magic = 0x81;
+    r.opcode = h->opcode;
+    r.opaque = h->opaque;
+    if (h->opcode == CMD_GET) r.status = htons(0x0001); // Key not found.
+    out.append((const char *) &r, 24);
+
+    pos += len;
+  }
+
+  return pos;
+}
+
+/*
+ * Answer every complete RESP array command; returns bytes consumed.
+ */
+static size_t serve_resp(const std::string &in, std::string &out) {
+  size_t pos = 0;
+
+  while (pos < in.size()) {
+    size_t eol = in.find("\r\n", pos);
+    if (eol == std::string::npos) break;
+
+    if (in[pos] != '*') { // Inline command.
+      out += "+OK\r\n";
+      pos = eol + 2;
+      continue;
+    }
+
+    int argc = atoi(in.c_str() + pos + 1);
+    size_t p = eol + 2;
+    std::string cmd;
+    bool complete = true;
+
+    for (int i = 0; i < argc; i++) {
+      size_t e = in.find("\r\n", p);
+      if (e == std::string::npos || in[p] != '$') { complete = false; break; }
+      size_t n = atoi(in.c_str() + p + 1);
+      if (in.size() < e + 2 + n + 2) { complete = false; break; }
+      if (i == 0) cmd = in.substr(e + 2, n);
+      p = e + 2 + n + 2;
+    }
+
+    if (!complete) break;
+
+    if (!strcasecmp(cmd.c_str(), "GET") || !strcasecmp(cmd.c_str(), "HGET"))
+      out += "$-1\r\n";
+    else if (!strcasecmp(cmd.c_str(), "HSET"))
+      out += ":1\r\n";
+    else
+      out += "+OK\r\n";
+
+    pos = p;
+  }
+
+  return pos;
+}
+
+static void loopback_close(int ep, int fd,
+                           std::unordered_map<int,loopback_client> &clients) {
+  epoll_ctl(ep, EPOLL_CTL_DEL, fd, NULL);
+  close(fd);
+  clients.erase(fd);
+}
+
+/*
+ * Write as much pending output as the socket takes, and only watch for
+ * writability while some is left over.
+ */
+static bool loopback_flush(int ep, int fd, loopback_client &c) {
+  size_t sent = 0;
+
+  while (sent < c.out.size()) {
+    ssize_t n = send(fd, c.out.data() + sent, c.out.size() - sent,
+                     MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      if (errno == EINTR) continue;
+      return false;
+    }
+    sent += n;
+  }
+
+  c.out.erase(0, sent);
+
+  bool want = c.out.size() > 0;
+  if (want != c.want_write) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (want ? EPOLLOUT : 0);
+    ev.data.fd = fd;
+    epoll_ctl(ep, EPOLL_CTL_MOD, fd, &ev);
+    c.want_write = want;
+  }
+
+  return true;
+}
+
+static void *loopback_thread(void *arg) {
+  int listener = (int) (long) arg;
+  std::unordered_map<int,loopback_client> clients;
+  struct epoll_event ev, events[LOOPBACK_EVENTS];
+  char *buf = new char[LOOPBACK_READ];
+
+  int ep = epoll_create1(0);
+  if (ep < 0) DIE("epoll_create1(): %s", strerror(errno));
+
+  ev.events = EPOLLIN;
+  ev.data.fd = listener;
+  if (epoll_ctl(ep, EPOLL_CTL_ADD, listener, &ev) < 0)
+    DIE("epoll_ctl(): %s", strerror(errno));
+
+  while (1) {
+    int n = epoll_wait(ep, events, LOOPBACK_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      DIE("epoll_wait(): %s", strerror(errno));
+    }
+
+    for (int i = 0; i < n; i++) {
+      int fd = events[i].data.fd;
+
+      if (fd == listener) {
+        int cfd;
+        while ((cfd = accept4(listener, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+          int one = 1;
+          setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+          ev.events = EPOLLIN;
+          ev.data.fd = cfd;
+          epoll_ctl(ep, EPOLL_CTL_ADD, cfd, &ev);
+          clients[cfd] = loopback_client();
+        }
+        continue;
+      }
+
+      loopback_client &c = clients[fd];
+
+      if (events[i].events & EPOLLOUT) {
+        if (!loopback_flush(ep, fd, c)) {
+          loopback_close(ep, fd, clients);
+          continue;
+        }
+      }
+
+      if (!(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) continue;
+
+      bool closed = false;
+      while (1) {
+        ssize_t r = recv(fd, buf, LOOPBACK_READ, 0);
+        if (r > 0) {
+          c.in.append(buf, r);
+          if (r < LOOPBACK_READ) break;
+        } else if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK &&
+                              errno != EINTR)) {
+          closed = true;
+          break;
+        } else break;
+      }
+
+      if (closed) {
+        loopback_close(ep, fd, clients);
+        continue;
+      }
+
+      if (c.proto == UNKNOWN && c.in.size() > 0) {
+        if ((uint8_t) c.in[0] == 0x80) c.proto = BINARY;
+        else if (c.in[0] == '*') c.proto = RESP;
+        else c.proto = ASCII;
+      }
+
+      size_t used = 0;
+      switch (c.proto) {
+      case ASCII:  used = serve_ascii(c.in, c.out); break;
+      case BINARY: used = serve_binary(c.in, c.out); break;
+      case RESP:   used = serve_resp(c.in, c.out); break;
+      case UNKNOWN: break;
+      }
+      c.in.erase(0, used);
+
+      if (!loopback_flush(ep, fd, c)) loopback_close(ep, fd, clients);
+    }
+  }
+
+  return NULL;
+}
+
+LoopbackServer::LoopbackServer(int threads) : port(0) {
+  for (int t = 0; t < threads; t++) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) DIE("socket(): %s", strerror(errno));
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+      DIE("setsockopt(SO_REUSEPORT): %s", strerror(errno));
+
+    // The first listener picks an ephemeral port, the rest share it.
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = htons(port);
+
+    if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+      DIE("bind(): %s", strerror(errno));
+    if (listen(fd, 1024) < 0) DIE("listen(): %s", strerror(errno));
+
+    if (port == 0) {
+      if (getsockname(fd, (struct sockaddr *) &sin, &len) < 0)
+        DIE("getsockname(): %s", strerror(errno));
+      port = ntohs(sin.sin_port);
+    }
+
+    pthread_t pt;
+    if (pthread_create(&pt, NULL, loopback_thread, (void *) (long) fd))
+      DIE("pthread_create() failed");
+    pthread_detach(pt);
+  }
+
+  V("Loopback server listening on %s (%d threads).", address().c_str(),
+    threads);
+}
+
+std::string LoopbackServer::address() const {
+  return "127.0.0.1:" + std::to_string(port);
+}
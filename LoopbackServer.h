@@ -0,0 +1,25 @@
+/* -*- c++ -*- */
+#ifndef LOOPBACKSERVER_H
+#define LOOPBACKSERVER_H
+
+#include <string>
+
+// In-process stand-in server on 127.0.0.1 for benchmarking the client
+// itself (e.g. comparing --engine choices).  It stores nothing: gets
+// miss, sets and anything else succeed.  Speaks ASCII and binary
+// memcached and RESP, detected from the first byte of each connection.
+//
+// Each server thread owns an SO_REUSEPORT listener and an epoll loop,
+// so the kernel spreads connections across threads.  The threads run
+// until the process exits.
+class LoopbackServer {
+public:
+  LoopbackServer(int threads);
+
+  std::string address() const;
+
+private:
+  int port;
+};
+
+#endif // LOOPBACKSERVER_H
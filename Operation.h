@@ -8,7 +8,13 @@ using namespace std;
 
 class Operation {
 public:
+  Operation() : start_time(0), end_time(0), send_time(0),
+                ktx_time(0), krx_time(0) {}
+
   double start_time, end_time;
+  double send_time;  // Last request byte flushed to the kernel (0 = unknown).
+  double ktx_time;   // SO_TIMESTAMPING software TX of the last request byte.
+  double krx_time;   // SO_TIMESTAMPING software RX of the response.
 
   enum type_enum {
     GET, SET, DELETE, SASL
@@ -23,6 +29,9 @@ public:
   pthread_mutex_t *lock;
 
   double time() const { return (end_time - start_time) * 1000000; }
+  double tx_wait() const { return (send_time - start_time) * 1000000; }
+  double wire_time() const { return (end_time - send_time) * 1000000; }
+  double kernel_time() const { return (krx_time - ktx_time) * 1000000; }
 };
 
 
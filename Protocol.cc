@@ -418,6 +418,8 @@ bool ProtocolAscii::handle_response(evbuffer *input, bool &done, bool &found, in
           conn->stats.get_misses++;
           conn->stats.window_get_misses++;
           found = false;
+      } else {
+          obj_size = data_length;
       }
       read_state = WAITING_FOR_GET;
       done = true;
@@ -12,9 +12,9 @@ class Connection;
 
 class Protocol {
 public:
-  Protocol(options_t _opts, Connection* _conn, bufferevent* _bev):
+  Protocol(const options_t &_opts, Connection* _conn, bufferevent* _bev):
     opts(_opts), conn(_conn), bev(_bev) {};
-  ~Protocol() {};
+  virtual ~Protocol() {};
 
   virtual bool setup_connection_w() = 0;
   virtual bool setup_connection_r(evbuffer* input) = 0;
@@ -24,14 +24,14 @@ public:
   virtual bool handle_response(evbuffer* input, bool &done, bool &found, int &obj_size, uint32_t &opaque) = 0;
 
 protected:
-  options_t    opts;
+  const options_t &opts; // The connection's, shared by its thread.
   Connection*  conn;
   bufferevent* bev;
 };
 
 class ProtocolAscii : public Protocol {
 public:
-  ProtocolAscii(options_t opts, Connection* conn, bufferevent* bev):
+  ProtocolAscii(const options_t &opts, Connection* conn, bufferevent* bev):
     Protocol(opts, conn, bev) {
     read_state = IDLE;
   };
@@ -61,7 +61,7 @@ private:
 
 class ProtocolBinary : public Protocol {
 public:
-  ProtocolBinary(options_t opts, Connection* conn, bufferevent* bev):
+  ProtocolBinary(const options_t &opts, Connection* conn, bufferevent* bev):
     Protocol(opts, conn, bev) {};
   ~ProtocolBinary() {};
 
@@ -75,7 +75,7 @@ public:
 
 class ProtocolRESP : public Protocol {
 public:
-  ProtocolRESP(options_t opts, Connection* conn, bufferevent* bev):
+  ProtocolRESP(const options_t &opts, Connection* conn, bufferevent* bev):
     Protocol(opts, conn, bev) {};
   ~ProtocolRESP() {};
 
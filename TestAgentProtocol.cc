@@ -0,0 +1,303 @@
+// Round trips through the agent protocol's encoding.  The option ids
+// and skipping unknown fields are what let a master and its agents be
+// different builds, so they are pinned here.
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "AgentProtocol.h"
+#include "log.h"
+#include "mutilate.h"
+
+// The samplers look at the command line; all options off.
+gengetopt_args_info args;
+
+static int failures = 0;
+
+#define CHECK(cond) do {                                        \
+    if (!(cond)) {                                              \
+      fprintf(stderr, "%s:%d: FAILED: %s\n", __FILE__, __LINE__, #cond); \
+      failures++;                                               \
+    }                                                           \
+  } while (0)
+
+// Every options_t field set to something other than its zero value,
+// and different from its neighbours, so a swapped id shows.
+static options_t sample_options() {
+  options_t o;
+  memset(&o, 0, sizeof(o));
+
+  o.connections = 3;
+  o.blocking = true;
+  o.lambda = 1234.5;
+  o.qps = 100000;
+  o.records = 10000;
+  o.misswindow = 7;
+  o.queries = 50;
+  o.assoc = 4;
+  strcpy(o.file_name, "trace.zst");
+  o.read_file = true;
+  o.binary = true;
+  o.unix_socket = true;
+  o.successful_queries = true;
+  o.use_assoc = true;
+  o.redis = true;
+  o.getset = true;
+  o.getsetorset = true;
+  o.delete90 = true;
+  o.sasl = true;
+  strcpy(o.username, "user");
+  strcpy(o.password, "secret");
+  strcpy(o.prefix, "pre:");
+  strcpy(o.hashtype, "fnv_64");
+  strcpy(o.keysize, "fb_key");
+  strcpy(o.valuesize, "fb_value");
+  strcpy(o.ia, "fb_ia");
+  o.twitter_trace = 2;
+  o.update = 0.25;
+  o.time = 30;
+  o.loadonly = true;
+  o.depth = 8;
+  o.no_nodelay = true;
+  o.noload = true;
+  o.threads = 6;
+  o.iadist = ZIPFIAN;
+  o.warmup = 5;
+  o.skip = true;
+  o.roundrobin = true;
+  o.server_given = 9;
+  o.lambda_denom = 11;
+  o.oob_thread = true;
+  o.moderate = true;
+  o.hotkeys = 12;
+  o.wire_timestamps = true;
+  o.kernel_timestamps = true;
+  strcpy(o.engine, "uring");
+  o.busy_poll = 13;
+  o.so_busy_poll = 14;
+
+  return o;
+}
+
+static AgentMessage reencode(const AgentMessage &m) {
+  return AgentMessage(m.encoded().data(), m.encoded().size());
+}
+
+// The ids are fixed once released; this is the table as shipped.
+static void test_option_ids() {
+  options_t o = sample_options();
+  AgentMessage out(MSG_PREPARE);
+  put_options(out, o);
+  AgentMessage m = reencode(out);
+
+#define INT(id, name)    CHECK(m.get_i64(id) == o.name)
+#define BOOL(id, name)   CHECK(m.get_u64(id) == (uint64_t) o.name)
+#define DOUBLE(id, name) CHECK(m.get_double(id) == o.name)
+#define STRING(id, name) CHECK(m.get_string(id) == o.name)
+  INT(1, connections);
+  BOOL(2, blocking);
+  DOUBLE(3, lambda);
+  INT(4, qps);
+  INT(5, records);
+  INT(6, misswindow);
+  INT(7, queries);
+  INT(8, assoc);
+  STRING(9, file_name);
+  BOOL(10, read_file);
+  BOOL(11, binary);
+  BOOL(12, unix_socket);
+  BOOL(13, successful_queries);
+  BOOL(14, use_assoc);
+  BOOL(15, redis);
+  BOOL(16, getset);
+  BOOL(17, getsetorset);
+  BOOL(18, delete90);
+  BOOL(19, sasl);
+  STRING(20, username);
+  STRING(21, password);
+  STRING(22, prefix);
+  STRING(23, hashtype);
+  STRING(24, keysize);
+  STRING(25, valuesize);
+  STRING(26, ia);
+  INT(27, twitter_trace);
+  DOUBLE(28, update);
+  INT(29, time);
+  BOOL(30, loadonly);
+  INT(31, depth);
+  BOOL(32, no_nodelay);
+  BOOL(33, noload);
+  INT(34, threads);
+  INT(35, iadist);
+  INT(36, warmup);
+  BOOL(37, skip);
+  BOOL(38, roundrobin);
+  INT(39, server_given);
+  INT(40, lambda_denom);
+  BOOL(41, oob_thread);
+  BOOL(42, moderate);
+  INT(43, hotkeys);
+  BOOL(44, wire_timestamps);
+  BOOL(45, kernel_timestamps);
+  STRING(46, engine);
+  INT(47, busy_poll);
+  INT(48, so_busy_poll);
+#undef INT
+#undef BOOL
+#undef DOUBLE
+#undef STRING
+
+  CHECK(!m.has(49));
+}
+
+// Everything put_options() sends, get_options() restores.
+static void test_options_round_trip() {
+  options_t o = sample_options();
+  AgentMessage out(MSG_PREPARE);
+  put_options(out, o);
+
+  options_t back;
+  memset(&back, 0, sizeof(back));
+  get_options(reencode(out), &back);
+  CHECK(!memcmp(&o, &back, sizeof(o)));
+}
+
+// Fields from a newer peer are skipped, and options the message lacks
+// are left alone.
+static void test_unknown_fields() {
+  options_t o = sample_options();
+  AgentMessage out(MSG_PREPARE);
+  out.put_u64(999, 7);
+  put_options(out, o);
+  out.put_string(60000, "from the future");
+  out.put_message(60001, AgentMessage(MSG_ACK));
+
+  AgentMessage m = reencode(out);
+  CHECK(m.type() == MSG_PREPARE);
+  CHECK(m.version() == AGENT_PROTOCOL_VERSION);
+  CHECK(m.get_u64(999) == 7);
+
+  options_t back;
+  memset(&back, 0, sizeof(back));
+  get_options(m, &back);
+  CHECK(!memcmp(&o, &back, sizeof(o)));
+
+  AgentMessage empty(MSG_PREPARE);
+  options_t kept = sample_options();
+  get_options(reencode(empty), &kept);
+  CHECK(!memcmp(&o, &kept, sizeof(o)));
+
+  // Missing fields read as their defaults.
+  CHECK(empty.get_u64(1, 42) == 42);
+  CHECK(reencode(empty).get_double(3, 0.5) == 0.5);
+  CHECK(reencode(empty).get_string(9, "none") == "none");
+}
+
+static void test_version_check() {
+  CHECK(agent_version_check(AGENT_PROTOCOL_VERSION).empty());
+  CHECK(agent_version_check(AGENT_PROTOCOL_MIN).empty());
+  CHECK(!agent_version_check(AGENT_PROTOCOL_MIN - 1).empty());
+  CHECK(!agent_version_check(AGENT_PROTOCOL_VERSION + 1).empty());
+}
+
+// Decoding a malformed message DIE()s; run it in a child.
+static bool decode_dies(const std::string &encoded) {
+  pid_t pid = fork();
+  if (pid < 0) DIE("fork() failed");
+
+  if (pid == 0) {
+    log_level = QUIET;
+    AgentMessage m(encoded.data(), encoded.size());
+    _exit(0);
+  }
+
+  int status;
+  if (waitpid(pid, &status, 0) != pid) DIE("waitpid() failed");
+  return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+static void test_truncated() {
+  AgentMessage out(MSG_PREPARE);
+  out.put_u64(1, 3);
+  out.put_string(9, "trace.zst");
+  const std::string &e = out.encoded();
+
+  CHECK(!decode_dies(e));
+  // Header, then cut inside each field's header and data.
+  for (size_t len = 0; len < e.size(); len++) {
+    bool boundary = len == 8 || len == 8 + 6 + 8;
+    if (!boundary) CHECK(decode_dies(e.substr(0, len)));
+  }
+  CHECK(decode_dies(std::string("XXXX") + e.substr(4)));
+}
+
+static void test_stats_round_trip() {
+  ConnectionStats stats;
+  Operation op;
+
+  for (int i = 0; i < 100; i++) {
+    op.start_time = 1.0;
+    op.end_time = 1.0 + (i + 1) * 0.000010;
+    stats.log_get(op);
+    if (i % 4 == 0) stats.log_set(op);
+  }
+  stats.rx_bytes = 1000;
+  stats.tx_bytes = 2000;
+  stats.accesses = 125;
+  stats.get_misses = 17;
+  stats.skips = 3;
+  stats.start = 10.0;
+  stats.stop = 12.5;
+
+  AgentStats as;
+  ConnectionStats latency;
+  decode_stats(reencode(encode_stats(stats)), &as, &latency);
+
+  CHECK(as.rx_bytes == 1000);
+  CHECK(as.tx_bytes == 2000);
+  CHECK(as.gets == 100);
+  CHECK(as.sets == 25);
+  CHECK(as.accesses == 125);
+  CHECK(as.get_misses == 17);
+  CHECK(as.skips == 3);
+  CHECK(as.start == 10.0);
+  CHECK(as.stop == 12.5);
+
+#if !defined(USE_ADAPTIVE_SAMPLER) && !defined(USE_HISTOGRAM_SAMPLER)
+  CHECK(latency.get_sampler.bins == stats.get_sampler.bins);
+  CHECK(latency.get_sampler.sum == stats.get_sampler.sum);
+  CHECK(latency.get_sampler.sum_sq == stats.get_sampler.sum_sq);
+  CHECK(latency.set_sampler.bins == stats.set_sampler.bins);
+  CHECK(latency.get_sampler.get_nth(99) == stats.get_sampler.get_nth(99));
+#endif
+
+  // Without a histogram to fill, only the counters are read.
+  AgentStats counters;
+  decode_stats(reencode(encode_stats(stats)), &counters);
+  CHECK(counters.gets == 100);
+}
+
+int main(int argc, char **argv) {
+  test_option_ids();
+  test_options_round_trip();
+  test_unknown_fields();
+  test_version_check();
+  test_truncated();
+  test_stats_round_trip();
+
+  if (failures) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+
+  printf("agent protocol: ok\n");
+  return 0;
+}
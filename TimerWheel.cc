@@ -0,0 +1,271 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
+
+#include "log.h"
+#include "TimerWheel.h"
+#include "util.h"
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+static void wheel_cb(evutil_socket_t fd, short what, void *ptr) {
+  TimerWheel *wheel = (TimerWheel *) ptr;
+
+#ifdef __linux__
+  uint64_t expirations;
+  if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+    DIE("read(timerfd): %s", strerror(errno));
+#endif
+
+  wheel->expire();
+}
+
+TimerWheel::TimerWheel(struct event_base *base) :
+  count(0), expiring(false), armed(0)
+{
+  memset(slots, 0, sizeof(slots));
+  memset(occupied, 0, sizeof(occupied));
+  now_tick = now_ns() >> WHEEL_TICK_SHIFT;
+
+#ifdef __linux__
+  fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd < 0) DIE("timerfd_create(): %s", strerror(errno));
+  ev = event_new(base, fd, EV_READ | EV_PERSIST, wheel_cb, this);
+  event_add(ev, NULL);
+#else
+  fd = -1;
+  ev = evtimer_new(base, wheel_cb, this);
+#endif
+}
+
+TimerWheel::~TimerWheel() {
+  event_free(ev);
+  if (fd >= 0) close(fd);
+}
+
+uint64_t TimerWheel::now_ns() {
+#ifdef __linux__
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+  return (uint64_t) (get_time() * 1000000000);
+#endif
+}
+
+void TimerWheel::add(wheel_timer *t, double delay) {
+  uint64_t now = now_ns();
+
+  if (t->pending()) {
+    unlink(t);
+  } else {
+    // Nothing to catch up on while empty, so skip expire()'s walk.
+    if (count == 0 && !expiring) now_tick = now >> WHEEL_TICK_SHIFT;
+    count++;
+  }
+
+  t->deadline = now + (delay > 0 ? (uint64_t) (delay * 1000000000) : 0);
+  insert(t);
+
+  if (!expiring && (armed == 0 || t->deadline < armed)) arm();
+}
+
+void TimerWheel::del(wheel_timer *t) {
+  if (!t->pending()) return;
+  unlink(t);
+  count--;
+}
+
+/**
+ * Put t in the slot for its deadline: level 0 if it is due within
+ * WHEEL_SLOTS ticks, else the level whose slots are coarse enough.
+ * Overdue timers go in the current slot.
+ */
+void TimerWheel::insert(wheel_timer *t) {
+  uint64_t tick = t->deadline >> WHEEL_TICK_SHIFT;
+  if (tick < now_tick) tick = now_tick;
+
+  uint64_t diff = tick - now_tick;
+  int level = 0;
+  while (level < WHEEL_LEVELS - 1 &&
+         diff >= 1ULL << ((level + 1) * WHEEL_SLOT_BITS))
+    level++;
+
+  // Beyond the top level; wait in its last slot and re-insert from there.
+  uint64_t range = 1ULL << (WHEEL_LEVELS * WHEEL_SLOT_BITS);
+  if (diff >= range) tick = now_tick + range - 1;
+
+  int idx = (tick >> (level * WHEEL_SLOT_BITS)) & WHEEL_MASK;
+  wheel_timer **head = &slots[level][idx];
+
+  t->next = *head;
+  if (t->next) t->next->pprev = &t->next;
+  t->pprev = head;
+  *head = t;
+
+  if (level == 0) occupied[idx / 64] |= 1ULL << (idx % 64);
+}
+
+void TimerWheel::unlink(wheel_timer *t) {
+  wheel_timer **head = t->pprev;
+
+  *head = t->next;
+  if (t->next) t->next->pprev = head;
+  t->next = NULL;
+  t->pprev = NULL;
+
+  if (*head == NULL && head >= &slots[0][0] && head < &slots[0][WHEEL_SLOTS]) {
+    int idx = head - &slots[0][0];
+    occupied[idx / 64] &= ~(1ULL << (idx % 64));
+  }
+}
+
+/**
+ * Move the timers in level 0 slot idx that are due by now onto *due.
+ * Ones later in the current tick go back in the slot.
+ */
+void TimerWheel::collect(int idx, uint64_t now, wheel_timer **due) {
+  wheel_timer *list = slots[0][idx];
+  if (list == NULL) return;
+
+  slots[0][idx] = NULL;
+  occupied[idx / 64] &= ~(1ULL << (idx % 64));
+  list->pprev = &list;
+
+  while (list) {
+    wheel_timer *t = list;
+    unlink(t);
+
+    if (t->deadline > now) {
+      insert(t);
+      continue;
+    }
+
+    t->next = *due;
+    if (t->next) t->next->pprev = &t->next;
+    t->pprev = due;
+    *due = t;
+  }
+}
+
+/**
+ * now_tick just started a new turn of level 0: move the timers of each
+ * higher level's next slot down, as far as they now fit.
+ */
+void TimerWheel::cascade() {
+  for (int level = 1; level < WHEEL_LEVELS; level++) {
+    int idx = (now_tick >> (level * WHEEL_SLOT_BITS)) & WHEEL_MASK;
+    wheel_timer *list = slots[level][idx];
+
+    if (list) {
+      slots[level][idx] = NULL;
+      list->pprev = &list;
+      while (list) {
+        wheel_timer *t = list;
+        unlink(t);
+        insert(t);
+      }
+    }
+
+    if (idx != 0) break;
+  }
+}
+
+/**
+ * The next occupied tick of level 0 before it wraps, or the tick at
+ * which it does.
+ */
+uint64_t TimerWheel::next_tick() const {
+  int from = (now_tick & WHEEL_MASK) + 1;
+
+  for (int w = from / 64; w < WHEEL_SLOTS / 64; w++) {
+    uint64_t bits = occupied[w];
+    if (w == from / 64) bits &= ~0ULL << (from % 64);
+    if (bits) return (now_tick & ~(uint64_t) WHEEL_MASK) + w * 64 +
+                __builtin_ctzll(bits);
+  }
+
+  return (now_tick | WHEEL_MASK) + 1;
+}
+
+/**
+ * Bring the wheel up to now, then fire everything that came due as one
+ * batch.  Timers that callbacks add are placed against the up to date
+ * wheel, and ones already due are left for the next expire().
+ */
+void TimerWheel::expire() {
+  uint64_t now = now_ns();
+  uint64_t target = now >> WHEEL_TICK_SHIFT;
+  wheel_timer *due = NULL;
+
+  while (1) {
+    collect(now_tick & WHEEL_MASK, now, &due);
+    if (now_tick >= target) break;
+
+    uint64_t next = next_tick();
+    now_tick = next < target ? next : target;
+    if ((now_tick & WHEEL_MASK) == 0) cascade();
+  }
+
+  // Still pending while on the list, so callbacks may del() any of them.
+  expiring = true;
+  while (due) {
+    wheel_timer *t = due;
+    unlink(t);
+    count--;
+    t->cb(t->arg);
+  }
+  expiring = false;
+
+  armed = 0;
+  arm();
+}
+
+/**
+ * Set the timerfd for the earliest deadline in the rest of level 0's
+ * current turn, or else for the start of the next turn, when higher
+ * levels cascade.
+ */
+void TimerWheel::arm() {
+  uint64_t deadline = 0;
+
+  if (count > 0) {
+    int idx = now_tick & WHEEL_MASK;
+    uint64_t tick = (occupied[idx / 64] & (1ULL << (idx % 64))) ?
+      now_tick : next_tick();
+
+    if ((tick & WHEEL_MASK) == 0 && tick != now_tick) {
+      deadline = tick << WHEEL_TICK_SHIFT;
+    } else {
+      for (wheel_timer *t = slots[0][tick & WHEEL_MASK]; t; t = t->next)
+        if (deadline == 0 || t->deadline < deadline) deadline = t->deadline;
+    }
+  }
+
+  if (deadline == armed) return;
+  armed = deadline;
+
+#ifdef __linux__
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = deadline / 1000000000;
+  its.it_value.tv_nsec = deadline % 1000000000;
+  if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL))
+    DIE("timerfd_settime(): %s", strerror(errno));
+#else
+  if (deadline == 0) {
+    evtimer_del(ev);
+  } else {
+    struct timeval tv;
+    uint64_t now = now_ns();
+    double_to_tv(deadline > now ? (deadline - now) / 1e9 : 0.0, &tv);
+    evtimer_add(ev, &tv);
+  }
+#endif
+}
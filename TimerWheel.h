@@ -0,0 +1,74 @@
+/* -*- c++ -*- */
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include <event2/event.h>
+
+#define WHEEL_LEVELS     4
+#define WHEEL_SLOT_BITS  8
+#define WHEEL_SLOTS      (1 << WHEEL_SLOT_BITS)
+#define WHEEL_TICK_SHIFT 10  // One tick is 1024ns.
+
+// A timer in a TimerWheel.  Embedded in its owner, so that arming it
+// never allocates.
+struct wheel_timer {
+  wheel_timer *next;
+  wheel_timer **pprev;  // NULL while not pending.
+  uint64_t deadline;    // CLOCK_MONOTONIC nanoseconds.
+  void (*cb)(void *arg);
+  void *arg;
+
+  wheel_timer() : next(NULL), pprev(NULL), deadline(0), cb(NULL), arg(NULL) {}
+  bool pending() const { return pprev != NULL; }
+};
+
+// Hierarchical hashed timing wheel that paces all of a thread's
+// connections, in place of an evtimer (and a libevent min-heap entry)
+// per connection.  Adding and removing a timer is O(1); WHEEL_LEVELS
+// levels of WHEEL_SLOTS slots cover 2^42ns (about 73 minutes), with
+// later timers parked in the top level until they come into range.
+//
+// Deadlines keep nanosecond precision: the wheel's single timerfd is
+// armed for the earliest deadline itself, not its tick, and each
+// expiry fires every timer that is due in one batch.  On systems
+// without timerfd a single evtimer stands in for it.
+class TimerWheel {
+public:
+  TimerWheel(struct event_base *base);
+  ~TimerWheel();
+
+  // Fire t->cb(t->arg) in delay seconds.  Re-adding a pending timer
+  // moves it.
+  void add(wheel_timer *t, double delay);
+  void del(wheel_timer *t);
+
+  // Run every timer that is due.  Called when the timerfd fires.
+  void expire();
+
+  size_t size() const { return count; }
+
+  static uint64_t now_ns();
+
+private:
+  wheel_timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+  uint64_t occupied[WHEEL_SLOTS / 64]; // Non-empty slots of level 0.
+  uint64_t now_tick;  // Ticks before this one have all been run.
+  size_t count;
+  bool expiring;      // Inside expire(); arm() once at its end.
+  uint64_t armed;     // Deadline the timerfd is set for; 0 = none.
+
+  struct event *ev;
+  int fd;
+
+  void insert(wheel_timer *t);
+  void unlink(wheel_timer *t);
+  void collect(int idx, uint64_t now, wheel_timer **due);
+  void cascade();
+  uint64_t next_tick() const;
+  void arm();
+};
+
+#endif // TIMERWHEEL_H
@@ -0,0 +1,170 @@
+#ifdef __linux__
+
+#include <dirent.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "log.h"
+#include "Topology.h"
+
+using namespace std;
+
+static bool read_line(const string &path, string &line) {
+  ifstream f(path.c_str());
+  return (bool) getline(f, line);
+}
+
+// Parse a /sys cpulist such as "0-3,8,10-11".
+static vector<int> parse_cpulist(const string &list) {
+  vector<int> cpus;
+  stringstream ss(list);
+  string range;
+
+  while (getline(ss, range, ',')) {
+    int lo, hi;
+    int n = sscanf(range.c_str(), "%d-%d", &lo, &hi);
+    if (n < 1) continue;
+    if (n == 1) hi = lo;
+    for (int c = lo; c <= hi; c++) cpus.push_back(c);
+  }
+
+  return cpus;
+}
+
+// Numeric suffixes of the directory entries under `dir` that start
+// with `prefix`, e.g. the N of /sys/devices/system/node/nodeN.
+static vector<int> list_numbered(const string &dir, const string &prefix) {
+  vector<int> ids;
+  DIR *d = opendir(dir.c_str());
+  if (d == NULL) return ids;
+
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    const char *name = e->d_name;
+    if (strncmp(name, prefix.c_str(), prefix.size())) continue;
+    name += prefix.size();
+    if (*name < '0' || *name > '9') continue;
+    ids.push_back(atoi(name));
+  }
+
+  closedir(d);
+  sort(ids.begin(), ids.end());
+  return ids;
+}
+
+Topology::Topology() {
+  cpu_set_t mask;
+  CPU_ZERO(&mask);
+  if (sched_getaffinity(0, sizeof(mask), &mask))
+    DIE("sched_getaffinity() failed");
+
+  cpu_node.assign(CPU_SETSIZE, 0);
+  for (int n: list_numbered("/sys/devices/system/node", "node")) {
+    string list;
+    if (!read_line("/sys/devices/system/node/node" + to_string(n) +
+                   "/cpulist", list)) continue;
+    for (int c: parse_cpulist(list))
+      if (c < CPU_SETSIZE) cpu_node[c] = n;
+  }
+
+  for (int c = 0; c < CPU_SETSIZE; c++) {
+    if (!CPU_ISSET(c, &mask)) continue;
+
+    cpu_info info;
+    info.id = c;
+    info.node = cpu_node[c];
+    info.primary = true;
+
+    string list;
+    if (read_line("/sys/devices/system/cpu/cpu" + to_string(c) +
+                  "/topology/thread_siblings_list", list)) {
+      vector<int> siblings = parse_cpulist(list);
+      if (siblings.size() > 0)
+        info.primary = *min_element(siblings.begin(), siblings.end()) == c;
+    }
+
+    cpus.push_back(info);
+  }
+}
+
+int Topology::node_of(int cpu) const {
+  if (cpu < 0 || cpu >= (int) cpu_node.size()) return -1;
+  return cpu_node[cpu];
+}
+
+vector<int> Topology::plan(int threads, const string &nic,
+                           bool nic_cpus) const {
+  vector<cpu_info> pool = cpus;
+
+  if (nic_cpus) {
+    vector<int> irq = nic_irq_cpus(nic);
+    vector<cpu_info> near;
+    for (auto &c: pool)
+      if (find(irq.begin(), irq.end(), c.id) != irq.end()) near.push_back(c);
+
+    if (near.size() > 0) pool = near;
+    else W("No usable CPUs take %s's interrupts; placing by topology.",
+           nic.c_str());
+  }
+
+  if (pool.size() == 0) DIE("No CPUs in the affinity mask?");
+
+  int home = nic.empty() ? -1 : nic_node(nic);
+  if (home < 0) home = pool[0].node;
+
+  stable_sort(pool.begin(), pool.end(),
+              [home](const cpu_info &a, const cpu_info &b) {
+                if ((a.node != home) != (b.node != home))
+                  return a.node == home;
+                return a.primary && !b.primary;
+              });
+
+  vector<int> result;
+  for (int t = 0; t < threads; t++)
+    result.push_back(pool[t % pool.size()].id);
+
+  return result;
+}
+
+string Topology::describe(const vector<int> &plan) const {
+  string s;
+
+  for (size_t t = 0; t < plan.size(); t++) {
+    if (t > 0) s += ", ";
+    s += to_string(plan[t]) + "/node" + to_string(node_of(plan[t]));
+  }
+
+  return s;
+}
+
+int Topology::nic_node(const string &nic) {
+  string line;
+  if (!read_line("/sys/class/net/" + nic + "/device/numa_node", line))
+    return -1;
+  return atoi(line.c_str());
+}
+
+vector<int> Topology::nic_irq_cpus(const string &nic) {
+  vector<int> cpus;
+  string dir = "/sys/class/net/" + nic + "/device/msi_irqs";
+
+  for (int irq: list_numbered(dir, "")) {
+    string base = "/proc/irq/" + to_string(irq), list;
+    if ((!read_line(base + "/effective_affinity_list", list) ||
+         list.empty()) &&
+        !read_line(base + "/smp_affinity_list", list)) continue;
+    for (int c: parse_cpulist(list))
+      if (find(cpus.begin(), cpus.end(), c) == cpus.end()) cpus.push_back(c);
+  }
+
+  sort(cpus.begin(), cpus.end());
+  return cpus;
+}
+
+#endif // __linux__
@@ -0,0 +1,43 @@
+/* -*- c++ -*- */
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <string>
+#include <vector>
+
+// CPU, NUMA and NIC layout from /sys, for deciding where to pin threads.
+// Only CPUs in the process's affinity mask are considered.  On systems
+// without the /sys files every CPU is its own core on node 0.
+class Topology {
+public:
+  Topology();
+
+  int node_of(int cpu) const;
+
+  // CPU for each of `threads` threads.  CPUs on the NIC's node come
+  // first (the node of the first usable CPU without a NIC), one
+  // hardware thread per core before any SMT siblings, so that threads
+  // spill onto another socket last.  With nic_cpus, only the CPUs that
+  // take the NIC's interrupts are used.
+  std::vector<int> plan(int threads, const std::string &nic,
+                        bool nic_cpus) const;
+
+  std::string describe(const std::vector<int> &plan) const;
+
+  // NUMA node of a network interface's device, or -1.
+  static int nic_node(const std::string &nic);
+  // CPUs the interrupts of a network interface's queues are routed to.
+  static std::vector<int> nic_irq_cpus(const std::string &nic);
+
+private:
+  struct cpu_info {
+    int id;
+    int node;
+    bool primary; // Lowest-numbered hardware thread of its core.
+  };
+
+  std::vector<cpu_info> cpus;  // Usable CPUs.
+  std::vector<int> cpu_node;   // NUMA node of every CPU, by id.
+};
+
+#endif // TOPOLOGY_H
@@ -0,0 +1,457 @@
+#include "config.h"
+
+#ifdef HAVE_DECL_IORING_REGISTER_PBUF_RING
+
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "Connection.h"
+#include "log.h"
+#include "UringEngine.h"
+
+// CQE user_data is the uring_conn pointer with the operation in the
+// low bit; 0 marks CQEs nobody waits for (cancellations).
+#define URING_RECV 0
+#define URING_SEND 1
+#define URING_OP(ud)   ((ud) & 1)
+#define URING_CONN(ud) ((void *) ((ud) & ~(uint64_t) 1))
+
+struct uring_conn {
+  UringEngine *engine;
+  Connection *conn;            // NULL once detached.
+  struct bufferevent *bev;
+  int fd;
+  struct evbuffer_cb_entry *cb;
+  struct evbuffer *inflight;   // Bytes handed to the in-flight send.
+  struct msghdr msg;
+  struct iovec iov[URING_IOV];
+  bool sending, receiving;
+  bool queued;                 // On the engine's send_queue.
+  int pending;                 // Submitted SQEs not yet completed.
+};
+
+static void uring_output_cb(struct evbuffer *buf,
+                            const struct evbuffer_cb_info *info, void *ptr);
+static void uring_cq_cb(evutil_socket_t fd, short what, void *ptr);
+static void uring_flush_cb(evutil_socket_t fd, short what, void *ptr);
+
+UringEngine::UringEngine(struct event_base *_base) :
+  base(_base), flush_pending(false), sq_local_tail(0), to_submit(0),
+  buf_tail(0), reap_depth(0)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+  p.cq_entries = URING_CQ_ENTRIES;
+
+  ring_fd = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &p);
+  if (ring_fd < 0) DIE("io_uring_setup(): %s", strerror(errno));
+  if (!(p.features & IORING_FEAT_NODROP))
+    DIE("--engine=uring needs IORING_FEAT_NODROP (Linux 5.5+)");
+
+  sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+
+  sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if (sq_ring == MAP_FAILED) DIE("mmap(SQ ring): %s", strerror(errno));
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ring = sq_ring;
+  } else {
+    cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED) DIE("mmap(CQ ring): %s", strerror(errno));
+  }
+
+  sqes = (struct io_uring_sqe *)
+    mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+         PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+         IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) DIE("mmap(SQEs): %s", strerror(errno));
+
+  char *sq = (char *) sq_ring, *cq = (char *) cq_ring;
+  sq_head = (unsigned *) (sq + p.sq_off.head);
+  sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  sq_mask = *(unsigned *) (sq + p.sq_off.ring_mask);
+  sq_entries = p.sq_entries;
+  cq_head = (unsigned *) (cq + p.cq_off.head);
+  cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  cq_mask = *(unsigned *) (cq + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+  // SQE slot i is always submitted from array slot i.
+  unsigned *array = (unsigned *) (sq + p.sq_off.array);
+  for (unsigned i = 0; i < sq_entries; i++) array[i] = i;
+  sq_local_tail = *sq_tail;
+
+  // Receive buffers the kernel picks from for every multishot recv.
+  buf_ring = (struct io_uring_buf_ring *)
+    mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf),
+         PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf_ring == MAP_FAILED) DIE("mmap(buffer ring): %s", strerror(errno));
+  bufs = new char[URING_BUFS * URING_BUF_SIZE];
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long) buf_ring;
+  reg.ring_entries = URING_BUFS;
+  reg.bgid = URING_BGID;
+  if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING,
+              &reg, 1) < 0)
+    DIE("io_uring provided buffer ring (Linux 5.19+): %s", strerror(errno));
+
+  for (unsigned i = 0; i < URING_BUFS; i++) recycle(i);
+  __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+
+  // Every CQE bumps the eventfd, and edge-triggered epoll reports each
+  // bump, so the counter never needs to be read back.
+  event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event_fd < 0) DIE("eventfd(): %s", strerror(errno));
+  if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_EVENTFD,
+              &event_fd, 1) < 0)
+    DIE("IORING_REGISTER_EVENTFD: %s", strerror(errno));
+
+  cq_event = event_new(base, event_fd, EV_READ | EV_PERSIST | EV_ET,
+                       uring_cq_cb, this);
+  event_add(cq_event, NULL);
+  flush_event = event_new(base, -1, 0, uring_flush_cb, this);
+}
+
+UringEngine::~UringEngine() {
+  // Cancelled recvs and in-flight sends still point at their buffers
+  // until the kernel says otherwise.  (--loadonly leaks its
+  // Connections, so some may still be attached.)
+  while (conns.size() > 0) detach(conns.begin()->first);
+  submit();
+  while (detached.size() > 0) {
+    if (syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS,
+                NULL, 0) < 0 && errno != EINTR)
+      DIE("io_uring_enter(): %s", strerror(errno));
+    reap();
+  }
+
+  event_free(cq_event);
+  event_free(flush_event);
+  close(ring_fd);
+  close(event_fd);
+
+  munmap(sqes, sq_entries * sizeof(struct io_uring_sqe));
+  if (cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+  munmap(sq_ring, sq_ring_size);
+  munmap(buf_ring, URING_BUFS * sizeof(struct io_uring_buf));
+  delete[] bufs;
+}
+
+/**
+ * Take over the socket: the bufferevent keeps its buffers but stops
+ * reading and writing.
+ */
+bool UringEngine::attach(Connection *conn, struct bufferevent *bev) {
+  uring_conn *uc = new uring_conn();
+
+  uc->engine = this;
+  uc->conn = conn;
+  uc->bev = bev;
+  uc->fd = bufferevent_getfd(bev);
+  uc->inflight = evbuffer_new();
+  uc->sending = uc->receiving = uc->queued = false;
+  uc->pending = 0;
+
+  bufferevent_disable(bev, EV_READ | EV_WRITE);
+  uc->cb = evbuffer_add_cb(bufferevent_get_output(bev), uring_output_cb, uc);
+  conns[conn] = uc;
+
+  arm_recv(uc);
+  queue(uc); // Submit the recv, plus anything already written.
+
+  return true;
+}
+
+void UringEngine::detach(Connection *conn) {
+  auto it = conns.find(conn);
+  if (it == conns.end()) return;
+
+  uring_conn *uc = it->second;
+  conns.erase(it);
+
+  evbuffer_remove_cb_entry(bufferevent_get_output(uc->bev), uc->cb);
+  uc->conn = NULL;
+  uc->bev = NULL;
+
+  if (uc->queued) {
+    send_queue.erase(std::remove(send_queue.begin(), send_queue.end(), uc),
+                     send_queue.end());
+    uc->queued = false;
+  }
+  readable.erase(std::remove(readable.begin(), readable.end(), uc),
+                 readable.end());
+
+  if (uc->receiving) {
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t) uc | URING_RECV;
+    sqe->user_data = 0;
+    // The bufferevent is about to close the fd.
+    submit();
+  }
+
+  // Inside reap(), uc may still be on the stack; the outermost reap()
+  // frees it.
+  if (uc->pending > 0 || reap_depth > 0) {
+    detached.push_back(uc);
+  } else {
+    evbuffer_free(uc->inflight);
+    delete uc;
+  }
+}
+
+struct io_uring_sqe *UringEngine::get_sqe() {
+  if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) ==
+      sq_entries)
+    submit();
+
+  struct io_uring_sqe *sqe = &sqes[sq_local_tail & sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_local_tail++;
+  to_submit++;
+  return sqe;
+}
+
+void UringEngine::submit() {
+  __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+
+  while (to_submit > 0) {
+    int r = syscall(__NR_io_uring_enter, ring_fd, to_submit, 0, 0, NULL, 0);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EBUSY || errno == EAGAIN) { reap(); continue; }
+      DIE("io_uring_enter(): %s", strerror(errno));
+    }
+    to_submit -= r;
+  }
+}
+
+/**
+ * Note that uc has output and make sure a flush runs before the event
+ * loop sleeps again.
+ */
+void UringEngine::queue(uring_conn *uc) {
+  if (!uc->queued) {
+    uc->queued = true;
+    send_queue.push_back(uc);
+  }
+
+  if (!flush_pending) {
+    flush_pending = true;
+    event_active(flush_event, EV_WRITE, 0);
+  }
+}
+
+void UringEngine::arm_recv(uring_conn *uc) {
+  struct io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = uc->fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BGID;
+  sqe->user_data = (uint64_t) uc | URING_RECV;
+
+  uc->receiving = true;
+  uc->pending++;
+}
+
+/**
+ * Move the output evbuffer's chains to the in-flight buffer (no copy)
+ * and send them with one SENDMSG.  Draining the output here is what
+ * --wire_timestamps sees as the flush.
+ */
+void UringEngine::start_send(uring_conn *uc) {
+  if (evbuffer_get_length(uc->inflight) == 0) {
+    struct evbuffer *output = bufferevent_get_output(uc->bev);
+    if (evbuffer_get_length(output) == 0) return;
+    evbuffer_remove_buffer(output, uc->inflight, evbuffer_get_length(output));
+  }
+
+  int n = evbuffer_peek(uc->inflight, -1, NULL, uc->iov, URING_IOV);
+  if (n > URING_IOV) n = URING_IOV;
+
+  memset(&uc->msg, 0, sizeof(uc->msg));
+  uc->msg.msg_iov = uc->iov;
+  uc->msg.msg_iovlen = n;
+
+  struct io_uring_sqe *sqe = get_sqe();
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = uc->fd;
+  sqe->addr = (uint64_t) &uc->msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = (uint64_t) uc | URING_SEND;
+
+  uc->sending = true;
+  uc->pending++;
+}
+
+/**
+ * Runs once per event loop pass in which anything was written: every
+ * queued send goes to the kernel in a single io_uring_enter().
+ */
+void UringEngine::flush() {
+  std::vector<uring_conn*> q;
+
+  // A full SQ can reap mid-loop, and completions may queue more sends.
+  flush_pending = false;
+  q.swap(send_queue);
+
+  for (uring_conn *uc: q) {
+    uc->queued = false;
+    if (uc->conn && !uc->sending) start_send(uc);
+  }
+
+  submit();
+}
+
+void UringEngine::recycle(unsigned short bid) {
+  // Not buf_ring->bufs: compiled as C++, the uapi flexible array wrapper
+  // puts it at offset 8 instead of overlaying the tail.
+  struct io_uring_buf *b =
+    (struct io_uring_buf *) buf_ring + (buf_tail & (URING_BUFS - 1));
+  b->addr = (uint64_t) (bufs + (size_t) bid * URING_BUF_SIZE);
+  b->len = URING_BUF_SIZE;
+  b->bid = bid;
+  buf_tail++;
+}
+
+void UringEngine::complete_recv(uring_conn *uc, struct io_uring_cqe *cqe) {
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (uc->conn && cqe->res > 0)
+      evbuffer_add(bufferevent_get_input(uc->bev),
+                   bufs + (size_t) bid * URING_BUF_SIZE, cqe->res);
+    recycle(bid);
+  }
+
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    uc->receiving = false;
+    uc->pending--;
+  }
+
+  if (!uc->conn) return;
+
+  if (cqe->res > 0) {
+    readable.push_back(uc);
+  } else if (cqe->res == 0) {
+    uc->conn->event_callback(BEV_EVENT_EOF);
+    return;
+  } else if (cqe->res != -ENOBUFS) {
+    errno = -cqe->res;
+    uc->conn->event_callback(BEV_EVENT_ERROR);
+    return;
+  }
+
+  // Multishot ends on ENOBUFS or when the kernel decides to; rearm.
+  if (!uc->receiving) {
+    arm_recv(uc);
+    queue(uc);
+  }
+}
+
+void UringEngine::complete_send(uring_conn *uc, struct io_uring_cqe *cqe) {
+  uc->sending = false;
+  uc->pending--;
+
+  if (!uc->conn) return;
+
+  if (cqe->res < 0) {
+    if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+      queue(uc);
+      return;
+    }
+    errno = -cqe->res;
+    uc->conn->event_callback(BEV_EVENT_ERROR);
+    return;
+  }
+
+  evbuffer_drain(uc->inflight, cqe->res);
+
+  if (evbuffer_get_length(uc->inflight) > 0 ||
+      evbuffer_get_length(bufferevent_get_output(uc->bev)) > 0)
+    queue(uc);
+}
+
+/**
+ * Consume every available CQE, then run each connection's read
+ * callback once for all the data it received.
+ *
+ * Completions can submit, and a full SQ or CQ makes submit() reap
+ * again.  So each CQE is copied and its slot released before it is
+ * handled, and a nested reap() carries on from there.  Read callbacks
+ * and freeing detached connections are left to the outermost call.
+ */
+void UringEngine::reap() {
+  unsigned head;
+
+  reap_depth++;
+
+  while ((head = *cq_head) != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe cqe = cqes[head & cq_mask];
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+    if (cqe.user_data == 0) continue;
+
+    uring_conn *uc = (uring_conn *) URING_CONN(cqe.user_data);
+    if (URING_OP(cqe.user_data) == URING_RECV) complete_recv(uc, &cqe);
+    else complete_send(uc, &cqe);
+  }
+
+  if (__atomic_load_n(&buf_ring->tail, __ATOMIC_RELAXED) != buf_tail)
+    __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+
+  if (reap_depth == 1) {
+    while (readable.size() > 0) {
+      std::vector<uring_conn*> ready;
+      ready.swap(readable);
+      for (uring_conn *uc: ready) {
+        if (!uc->conn) continue;
+        if (evbuffer_get_length(bufferevent_get_input(uc->bev)) > 0)
+          uc->conn->read_callback();
+      }
+    }
+
+    for (size_t i = 0; i < detached.size();) {
+      uring_conn *uc = detached[i];
+      if (uc->pending > 0) { i++; continue; }
+      detached[i] = detached.back();
+      detached.pop_back();
+      evbuffer_free(uc->inflight);
+      delete uc;
+    }
+  }
+
+  reap_depth--;
+}
+
+/* The follow are C trampolines for libevent callbacks. */
+static void uring_output_cb(struct evbuffer *buf,
+                            const struct evbuffer_cb_info *info, void *ptr) {
+  uring_conn *uc = (uring_conn *) ptr;
+  if (info->n_added > 0 && !uc->sending) uc->engine->queue(uc);
+}
+
+static void uring_cq_cb(evutil_socket_t fd, short what, void *ptr) {
+  ((UringEngine *) ptr)->reap();
+}
+
+static void uring_flush_cb(evutil_socket_t fd, short what, void *ptr) {
+  ((UringEngine *) ptr)->flush();
+}
+
+#endif // HAVE_DECL_IORING_REGISTER_PBUF_RING
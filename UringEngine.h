@@ -0,0 +1,79 @@
+/* -*- c++ -*- */
+#ifndef URINGENGINE_H
+#define URINGENGINE_H
+
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <unordered_map>
+#include <vector>
+
+#include <event2/buffer.h>
+
+#include "IOEngine.h"
+
+#define URING_SQ_ENTRIES 1024
+#define URING_CQ_ENTRIES 16384
+#define URING_BUFS       4096  // Provided receive buffers, power of two.
+#define URING_BUF_SIZE   4096
+#define URING_BGID       0
+#define URING_IOV        64    // Max evbuffer chains per send.
+
+// io_uring engine.  Every connection has one multishot recv pulling
+// from a provided-buffer ring shared by the thread, and all sends
+// queued during an event loop pass go out in a single io_uring_enter().
+// Completions are signalled on an eventfd watched by the libevent
+// base, so timers, DNS and --blocking work as before.
+//
+// Talks to the kernel through the raw syscalls rather than liburing.
+struct uring_conn; // Per-connection state, see UringEngine.cc.
+
+class UringEngine : public IOEngine {
+public:
+  UringEngine(struct event_base *base);
+  ~UringEngine();
+
+  bool attach(Connection *conn, struct bufferevent *bev);
+  void detach(Connection *conn);
+
+  // Called from the libevent callbacks in UringEngine.cc.
+  void flush();
+  void reap();
+  void queue(uring_conn *uc);
+
+private:
+  struct event_base *base;
+  struct event *cq_event;        // Eventfd readable: CQEs to reap.
+  struct event *flush_event;     // Manually activated: sends to submit.
+  bool flush_pending;
+  int ring_fd, event_fd;
+
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size;
+  unsigned *sq_head, *sq_tail, sq_mask, sq_entries;
+  unsigned *cq_head, *cq_tail, cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned sq_local_tail, to_submit;
+
+  struct io_uring_buf_ring *buf_ring;
+  char *bufs;
+  unsigned short buf_tail;
+
+  std::unordered_map<Connection*,uring_conn*> conns;
+  std::vector<uring_conn*> send_queue; // Connections with output to send.
+  std::vector<uring_conn*> readable;   // Connections with new input.
+  std::vector<uring_conn*> detached;   // Waiting for their last CQE.
+  int reap_depth;                      // reap() calls on the stack.
+
+  struct io_uring_sqe *get_sqe();
+  void submit();
+  void arm_recv(uring_conn *uc);
+  void start_send(uring_conn *uc);
+  void recycle(unsigned short bid);
+  void complete_recv(uring_conn *uc, struct io_uring_cqe *cqe);
+  void complete_send(uring_conn *uc, struct io_uring_cqe *cqe);
+};
+
+#endif // URINGENGINE_H
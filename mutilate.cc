@@ -1,16 +1,25 @@
 #include <arpa/inet.h>
 #include <assert.h>
+#include <errno.h>
+#include <math.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <sched.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <deque>
+#include <map>
 #include <queue>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -31,15 +40,26 @@
 #include <zmq.hpp>
 #endif
 
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
 #include "AdaptiveSampler.h"
+#include "AgentProtocol.h"
 #include "AgentStats.h"
+#include "Arena.h"
 #ifndef HAVE_PTHREAD_BARRIER_INIT
 #include "barrier.h"
 #endif
 #include "cmdline.h"
 #include "Connection.h"
+#include "ConnectionContext.h"
 #include "ConnectionOptions.h"
+#include "IOEngine.h"
+#include "LoadProfile.h"
 #include "log.h"
+#include "LoopbackServer.h"
+#include "Topology.h"
 #include "mutilate.h"
 #include "util.h"
 #include "blockingconcurrentqueue.h"
@@ -52,20 +72,65 @@ using namespace moodycamel;
 
 ifstream kvfile;
 pthread_mutex_t flock = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t *item_locks;
+pthread_mutex_t *item_locks = NULL;
 int item_lock_hashpower = 13;
 
 gengetopt_args_info args;
-char random_char[2 * 1024 * 1024];  // Buffer used to generate random values.
+// Buffer used to generate random values.  Aligned so that, with
+// --hugepages, it can be a single transparent hugepage.
+char random_char[HUGE_PAGE_SIZE] __attribute__((aligned(HUGE_PAGE_SIZE)));
+
+// Per-server breakdown of the last go(), keyed by "host:port".  With
+// --connection_stats, connections are also kept as "host:port#cid".
+map<string, ConnectionStats> server_stats;
 
 #ifdef HAVE_LIBZMQ
 vector<zmq::socket_t*> agent_sockets;
+vector<double> agent_offsets; // Each agent's get_time() minus ours.
 zmq::context_t context(1);
+
+#define SYNC_PINGS    16     // Clock readings per agent at each sync.
+#define SYNC_MIN_LEAD 0.005  // Seconds from sync to the start it sets.
+
+double sync_start; // Start instant from the last sync_agent(), our clock.
 #endif
 
+LoadProfile *profile = NULL; // --profile, or an agent's from its master.
+
+// --profile's report: each step's stats, across this client's threads.
+struct profile_step {
+  ConnectionStats stats;
+};
+
+vector<profile_step> profile_steps;
+pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+map<string, ConnectionStats> probe_stats; // Each --probe's, by host.
+bool probe_role = false;                  // This agent is a --probe.
+
+// An agent's threads' numbers for its heartbeats, as of each thread's
+// last beat; see heartbeat_cb().
+struct heartbeat_slot {
+  bool fresh;          // No beat yet this run.
+  double qps;          // Achieved over the last beat.
+  double target;       // lambda * connections, or 0 if unpaced.
+  double share;        // target before --balance scaled it.
+  size_t outstanding;  // Requests in flight.
+  double lag;          // Worst event loop lag over the beat, in us.
+  uint64_t skips;      // This run.
+};
+
+vector<heartbeat_slot*> heartbeat_slots;
+pthread_mutex_t heartbeat_lock = PTHREAD_MUTEX_INITIALIZER;
+double heartbeat_interval = 0;  // The master's --heartbeat; 0 for none.
+int heartbeat_threads = 0;      // Slots to expect in a run.
+double lambda_scale = 1;        // An agent's, from the master's --balance.
+int calibrate_time = 0;         // The master's --calibrate; 0 for none.
+
 struct thread_data {
   const vector<string> *servers;
   options_t *options;
+  map<string, ConnectionStats> *server_stats;
   bool master;  // Thread #0, not to be confused with agent master.
 #ifdef HAVE_LIBZMQ
   zmq::socket_t *socket;
@@ -77,8 +142,164 @@ struct thread_data {
 struct reader_data {
   ConcurrentQueue<string> *trace_queue;
   string trace_filename;
+  int twitter_trace;  // Trace format; see issue_getsetorset().
+};
+
+// With agents, each client replays the requests of one shard of the
+// --read_file trace, by key hash, so that every key's requests come
+// from one client in trace order.  The master assigns them.
+int trace_shard = 0;
+int trace_shards = 1;
+
+// Per-thread timer that measures how late the event loop runs it.
+#define LAG_PROBE_INTERVAL 0.001
+
+struct lag_probe {
+  struct event *timer;
+  double due;
+  ConnectionStats *stats;
+  double max_lag;  // Since heartbeat_cb() last read it, in us.
+};
+
+void lag_probe_cb(evutil_socket_t fd, short what, void *ptr) {
+  struct lag_probe *probe = (struct lag_probe *) ptr;
+  double now = get_time();
+  struct timeval tv;
+
+  double lag = (now - probe->due) * 1000000;
+  probe->stats->log_lag(lag);
+  if (lag > probe->max_lag) probe->max_lag = lag;
+
+  probe->due = now + LAG_PROBE_INTERVAL;
+  double_to_tv(LAG_PROBE_INTERVAL, &tv);
+  evtimer_add(probe->timer, &tv);
+}
+
+// Per-thread timer for the end of a timed run.  Connections count
+// themselves in `finished` as they complete, but one that is idle
+// (waiting on a reply, or past its last request) would not notice
+// the time is up, so this sweeps them all once at the deadline.
+struct run_deadline {
+  struct event *timer;
+  double due;
+  vector<Connection*> *connections;
 };
 
+void run_deadline_cb(evutil_socket_t fd, short what, void *ptr) {
+  struct run_deadline *deadline = (struct run_deadline *) ptr;
+  double now = get_time();
+  struct timeval tv;
+
+  // check_exit_condition() wants strictly past start_time + time.
+  if (now <= deadline->due) {
+    double_to_tv(deadline->due - now + 0.000001, &tv);
+    evtimer_add(deadline->timer, &tv);
+    return;
+  }
+
+  for (Connection *conn: *deadline->connections)
+    conn->check_exit_condition(now);
+}
+
+void run_until_finished(IOEngine *engine, struct event_base *base,
+                        int loop_flag, vector<Connection*> &connections,
+                        int &finished, double start, double time) {
+  struct run_deadline deadline;
+  struct timeval tv;
+
+  deadline.timer = evtimer_new(base, run_deadline_cb, &deadline);
+  deadline.due = start + time;
+  deadline.connections = &connections;
+  double_to_tv(time, &tv);
+  evtimer_add(deadline.timer, &tv);
+
+  while (finished < (int) connections.size()) engine->loop(base, loop_flag);
+
+  event_free(deadline.timer);
+}
+
+#ifdef __linux__
+Topology *topology = NULL; // Set for --placement=topology and nic.
+
+// CPU for each thread per --placement, or none to leave it to the OS.
+vector<int> plan_placement(int threads) {
+  vector<int> plan;
+
+  if (args.affinity_given || !strcmp(args.placement_arg, "none"))
+    return plan;
+
+  if (!strcmp(args.placement_arg, "cores")) {
+    int num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int t = 0; t < threads; t++) plan.push_back(t % num_cores);
+    return plan;
+  }
+
+  if (topology == NULL) topology = new Topology();
+  plan = topology->plan(threads, args.nic_given ? args.nic_arg : "",
+                        !strcmp(args.placement_arg, "nic"));
+  V("Thread CPUs: %s", topology->describe(plan).c_str());
+  return plan;
+}
+
+// Pin thread t, per --affinity (round-robin from current_cpu) or the
+// plan from plan_placement().
+void place_thread(pthread_attr_t *attr, const vector<int> &placement,
+                  int t, int &current_cpu) {
+  if (args.affinity_given) {
+    int max_cpus = 8 * sizeof(cpu_set_t);
+    cpu_set_t m;
+    CPU_ZERO(&m);
+    sched_getaffinity(0, sizeof(cpu_set_t), &m);
+
+    for (int i = 0; i < max_cpus; i++) {
+      int c = (current_cpu + i + 1) % max_cpus;
+      if (CPU_ISSET(c, &m)) {
+        CPU_ZERO(&m);
+        CPU_SET(c, &m);
+        int ret;
+        if ((ret = pthread_attr_setaffinity_np(attr,
+                                               sizeof(cpu_set_t), &m)))
+          DIE("pthread_attr_setaffinity_np(%d) failed: %s",
+              c, strerror(ret));
+        current_cpu = c;
+        break;
+      }
+    }
+  } else if (placement.size() > 0) {
+    // Start the thread on its CPU so that its stack, connections
+    // and stats are first touched, and so allocated, on its node.
+    cpu_set_t m;
+    CPU_ZERO(&m);
+    CPU_SET(placement[t], &m);
+    int ret;
+    if ((ret = pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &m)))
+      DIE("pthread_attr_setaffinity_np(%d) failed: %s",
+          placement[t], strerror(ret));
+  }
+}
+
+// Packets for a connection are received on the CPU its NIC queue
+// interrupts; if that is on another node, they cross sockets to reach
+// this thread.  Say so when it happens despite --placement.
+void check_rx_locality(const vector<Connection*> &connections) {
+  if (topology == NULL) return;
+
+  int node = topology->node_of(sched_getcpu());
+  int known = 0, remote = 0;
+
+  for (Connection *conn: connections) {
+    int cpu = conn->incoming_cpu();
+    if (cpu < 0) continue;
+    known++;
+    if (topology->node_of(cpu) != node) remote++;
+  }
+
+  if (remote > 0)
+    W("%d of %d connections on a node %d thread received on another node.",
+      remote, known, node);
+}
+#endif
+
 // struct evdns_base *evdns;
     
 pthread_t pt[1024];
@@ -97,42 +318,553 @@ void go(const vector<string> &servers, options_t &options,
 );
 
 void do_mutilate(const vector<string> &servers, options_t &options,
-                 ConnectionStats &stats,ConcurrentQueue<string> *trace_queue,  bool master = true
+                 ConnectionStats &stats, map<string, ConnectionStats> &server_stats,
+                 ConcurrentQueue<string> *trace_queue,  bool master = true
+#ifdef HAVE_LIBZMQ
+, zmq::socket_t* socket = NULL
+#endif
+);
+
+// One client thread's event loop, I/O engine and connections.  It lives
+// for one do_mutilate(), or for every step of --scan and --search on
+// the worker pool.
+struct worker {
+  struct event_base *base;
+  struct evdns_base *evdns;
+  struct event_config *config;
+  IOEngine *engine;
+  ConnectionContext *context; // Generators and stats for connections.
+  Arena *arena;               // With --hugepages, else NULL.
+  MemCounters *counters;
+  vector<Connection*> connections;
+  vector<Connection*> server_lead;
+  int finished; // Connections done with the current run.
+  int loop_flag;
+  double lambda_scale; // Of this run's lambda, as last set by --balance.
+};
+
+void worker_setup(struct worker &w, const vector<string> &servers,
+                  options_t &options, ConcurrentQueue<string> *trace_queue);
+void worker_run(struct worker &w, options_t &options,
+                ConnectionStats &stats, map<string, ConnectionStats> &server_stats,
+                bool master
 #ifdef HAVE_LIBZMQ
 , zmq::socket_t* socket = NULL
 #endif
 );
+void worker_drain(struct worker &w);
+void worker_teardown(struct worker &w);
+void report_mem_stats(const char *what, const mem_stats &before,
+                      const mem_stats &after);
+
+void pool_go(const vector<string> &servers, options_t &options,
+             ConnectionStats &stats);
+void pool_stop();
+void go_step(const vector<string> &servers, options_t &options,
+             ConnectionStats &stats);
+
 void args_to_options(options_t* options);
+void init_item_locks();
+void report_server_stats(bool print);
+void report_loop_lag(int thread, ConnectionStats &stats);
+void print_profile();
+void print_probes();
 void* thread_main(void *arg);
 void* reader_thread(void *arg);
 
 #ifdef HAVE_LIBZMQ
-static std::string s_recv (zmq::socket_t &socket) {
+static AgentMessage recv_msg(zmq::socket_t &socket) {
   zmq::message_t message;
   socket.recv(&message);
 
-  return std::string(static_cast<char*>(message.data()), message.size());
+  return AgentMessage(message.data(), message.size());
 }
 
-//  Convert string to 0MQ string and send to socket
-static bool s_send (zmq::socket_t &socket, const std::string &string) {
-  zmq::message_t message(string.size());
-  memcpy(message.data(), string.data(), string.size());
+static bool send_msg(zmq::socket_t &socket, const AgentMessage &m) {
+  zmq::message_t message(m.encoded().size());
+  memcpy(message.data(), m.encoded().data(), m.encoded().size());
 
   return socket.send(message);
 }
 
+/*
+ * Receive the next message, which must be of the given type and from
+ * a compatible peer.  An error from the agent ends the run.
+ */
+static AgentMessage expect_msg(zmq::socket_t &socket, agent_msg_t type,
+                               const char *where) {
+  AgentMessage m = recv_msg(socket);
+
+  string why = agent_version_check(m.version());
+  if (why.size()) DIE("%s: %s", where, why.c_str());
+  if (m.type() == MSG_ERROR)
+    DIE("%s: %s", where, m.get_string(ERROR_REASON).c_str());
+  if (m.type() != type)
+    DIE("%s: out of sync (message %d, expected %d)", where, m.type(), type);
+
+  return m;
+}
+
+/*
+ * Agents are enlisted as a tree --agent_fanout wide: a client talks to
+ * at most that many agents, each of which relays every phase of a run
+ * to an equal share of the rest and answers for all of them, merging
+ * their stats into its own.  The master's share of the work then
+ * grows with the fanout and the tree's depth, not with the number of
+ * agents.  agent_subtrees[i] are the agents that agent_sockets[i]
+ * relays to.
+ */
+vector< vector<string> > agent_subtrees;
+vector<string> enlisted;  // Endpoints last given to enlist_agents().
+int agent_fanout = 0;
+
+void finish_agent(ConnectionStats &stats, bool master_ran);
+
+/*
+ * --probe agents measure latency apart from the load: each sends a low
+ * --probe_qps over one connection per server at depth 1, samples every
+ * request and takes no part in lambda_denom.  The master reports each
+ * probe's latency on its own, e.g. to compare racks.
+ */
+map<zmq::socket_t*, string> probe_names;  // Master: probe sockets' hosts.
+
+/*
+ * --calibrate: before a run, each agent measures the rate it reaches
+ * unpaced with the run's threads, connections and depth, against a
+ * LoopbackServer in place of the servers so that they see no extra
+ * load.  Since the stand-in shares the agent's CPUs, the figure errs
+ * low.  Agents report it per unit of their lambda_denom weight, and a
+ * relay reports its subtree's lowest, so that the master can tell from
+ * --qps and lambda_denom how close to its limit each would run.
+ */
+struct calibration {
+  double per_weight;  // Capacity per unit of weight; 0 if unknown.
+  double qps;         // That agent's capacity.
+  string agent;
+};
+
+vector<calibration> agent_calibration;  // Worst of each agent's subtree.
+
+static string agent_name() {
+  char host[256] = "";
+  gethostname(host, sizeof(host) - 1);
+  return string(host) + ":" + to_string(getpid());
+}
+
+void enlist_agents(const vector<string> &endpoints, int fanout) {
+  agent_fanout = fanout;
+  if (endpoints == enlisted) return;  // A relay's next run.
+
+  for (auto s: agent_sockets) delete s;
+  agent_sockets.clear();
+  agent_subtrees.clear();
+  enlisted = endpoints;
+
+  size_t n = endpoints.size();
+  size_t roots = fanout > 0 && n > (size_t) fanout ? fanout : n;
+
+  for (size_t i = 0; i < roots; i++) {
+    size_t from = i * n / roots, to = (i + 1) * n / roots;
+    zmq::socket_t *s = new zmq::socket_t(context, ZMQ_REQ);
+    s->connect(endpoints[from].c_str());
+    agent_sockets.push_back(s);
+    agent_subtrees.push_back(vector<string>(endpoints.begin() + from + 1,
+                                            endpoints.begin() + to));
+  }
+}
+
+// Agents below us, at any depth.
+size_t agent_count() {
+  size_t n = 0;
+  for (auto &subtree: agent_subtrees) n += 1 + subtree.size();
+  return n;
+}
+
+// A client's part of lambda_denom, from its threads * --lambda_mul.
+static int agent_weight(const options_t &options, size_t servers,
+                        unsigned int num) {
+  return options.connections * (options.roundrobin ?
+                                (servers > num ? servers : num) :
+                                (servers * num));
+}
+
+// Send each agent we talk to the run's options, its subtree and its
+// --read_file shard, counting from `shard`.
+static void send_prepare(const vector<string> &servers,
+                         const options_t &options, int shard) {
+  for (size_t i = 0; i < agent_sockets.size(); i++) {
+    zmq::socket_t *s = agent_sockets[i];
+    AgentMessage prep(MSG_PREPARE);
+    put_options(prep, options);
+    for (auto &server: servers) prep.put_string(PREPARE_SERVER, server);
+    if (profile) prep.put_string(PREPARE_PROFILE, profile->spec());
+    prep.put_i64(PREPARE_TRACE_SHARD, shard);
+    prep.put_i64(PREPARE_TRACE_SHARDS, trace_shards);
+    for (auto &agent: agent_subtrees[i])
+      prep.put_string(PREPARE_AGENT, agent);
+    prep.put_i64(PREPARE_FANOUT, agent_fanout);
+    prep.put_double(PREPARE_HEARTBEAT, heartbeat_interval);
+    if (probe_names.count(s))
+      prep.put_i64(PREPARE_PROBE_QPS, args.probe_qps_arg);
+    prep.put_i64(PREPARE_CALIBRATE, calibrate_time);
+    send_msg(*s, prep);
+    shard += 1 + agent_subtrees[i].size();
+  }
+}
+
+// Their replies to send_prepare(), all sent before any is awaited so
+// that they calibrate at once.  Returns their part of lambda_denom.
+static int receive_prepared(const vector<string> &servers,
+                            const options_t &options) {
+  int sum = 0;
+  agent_calibration.clear();
+
+  for (size_t i = 0; i < agent_sockets.size(); i++) {
+    zmq::socket_t *s = agent_sockets[i];
+    AgentMessage rep = expect_msg(*s, MSG_PREPARED, "prepare_agents");
+    if (probe_names.count(s) && !rep.get_u64(PREPARED_PROBE))
+      DIE("prepare_agents: %s cannot be a --probe.  Is it an older "
+          "mutilate?", probe_names[s].c_str());
+    if ((size_t) rep.get_i64(PREPARED_AGENTS, 1) !=
+        1 + agent_subtrees[i].size())
+      DIE("prepare_agents: an agent did not enlist its %zu agents.  Is it "
+          "an older mutilate?", agent_subtrees[i].size());
+
+    if (rep.has(PREPARED_WEIGHT))
+      sum += rep.get_i64(PREPARED_WEIGHT);
+    else
+      sum += agent_weight(options, servers.size(), rep.get_i64(PREPARED_NUM));
+
+    calibration cal = { rep.get_double(PREPARED_CAPACITY),
+                        rep.get_double(PREPARED_CAPACITY_QPS),
+                        rep.get_string(PREPARED_CAPACITY_AGENT) };
+    agent_calibration.push_back(cal);
+  }
+
+  return sum;
+}
+
+static int prepare_agents(const vector<string> &servers,
+                          const options_t &options, int shard) {
+  send_prepare(servers, options, shard);
+  return receive_prepared(servers, options);
+}
+
+// With abort, the agents skip the run and wait for the next.
+static void send_lambda_denom(int denom, bool abort = false) {
+  for (auto s: agent_sockets) {
+    AgentMessage m(MSG_LAMBDA_DENOM);
+    m.put_i64(LAMBDA_DENOM, denom);
+    if (abort) m.put_u64(LAMBDA_ABORT, 1);
+    send_msg(*s, m);
+    expect_msg(*s, MSG_ACK, "send_lambda_denom");
+  }
+}
+
+/*
+ * Heartbeats.  While it runs, each agent publishes its achieved and
+ * assigned QPS, requests in flight, event loop lag and skips every
+ * --heartbeat on a ZMQ_PUB socket next to its ZMQ_REP one, and the
+ * master prints them as they come in.  An agent that falls behind its
+ * share, e.g. for want of CPU, is flagged at once rather than lowering
+ * the offered load unnoticed until the stats come in.
+ */
+#define HEARTBEAT_SHORTFALL 0.9  // Of its target QPS, to be flagged.
+
+vector<string> agent_endpoints;  // Every agent, for the master.
+
+// The PUB endpoint beside an agent's REP endpoint: the next port, or
+// the ipc:// path with ".hb" added.
+static string heartbeat_endpoint(const string &endpoint) {
+  size_t colon = endpoint.rfind(':');
+  if (endpoint.compare(0, 6, "tcp://") || colon < 6)
+    return endpoint + ".hb";
+  return endpoint.substr(0, colon + 1) +
+    to_string(atoi(endpoint.c_str() + colon + 1) + 1);
+}
+
+struct heartbeat_sockets {
+  zmq::socket_t *pub;      // Heartbeats out.
+  zmq::socket_t *balance;  // MSG_BALANCE in, for every agent.
+};
+
+// Agent: take MSG_BALANCE for us until `until`.
+static void balance_wait(zmq::socket_t *balance, const string &name,
+                         double until) {
+  for (double now = get_time(); now < until; now = get_time()) {
+    int timeout = (until - now) * 1000 + 1;
+    balance->setsockopt(ZMQ_RCVTIMEO, &timeout, sizeof(timeout));
+
+    zmq::message_t message;
+    if (!balance->recv(&message)) continue;
+
+    AgentMessage m(message.data(), message.size());
+    if (m.type() != MSG_BALANCE || agent_version_check(m.version()).size() ||
+        m.get_string(HB_AGENT) != name)
+      continue;
+
+    pthread_mutex_lock(&heartbeat_lock);
+    lambda_scale = m.get_double(BALANCE_SCALE, 1);
+    pthread_mutex_unlock(&heartbeat_lock);
+  }
+}
+
+// Agent: publish the sum of the running threads' heartbeat_slots.
+void* heartbeat_publisher(void *arg) {
+  struct heartbeat_sockets *sockets = (struct heartbeat_sockets *) arg;
+  string name = agent_name();
+
+  try {
+    while (1) {
+      balance_wait(sockets->balance, name, get_time() +
+                   (heartbeat_interval > 0 ? heartbeat_interval : 1.0));
+
+      AgentMessage beat(MSG_HEARTBEAT);
+      double qps = 0, target = 0, share = 0, lag = 0;
+      uint64_t outstanding = 0, skips = 0;
+      bool ready = true;
+
+      pthread_mutex_lock(&heartbeat_lock);
+      if ((int) heartbeat_slots.size() < heartbeat_threads) ready = false;
+      for (auto slot: heartbeat_slots) {
+        if (slot->fresh) ready = false;
+        qps += slot->qps;
+        target += slot->target;
+        share += slot->share;
+        outstanding += slot->outstanding;
+        lag = max(lag, slot->lag);
+        skips += slot->skips;
+      }
+      pthread_mutex_unlock(&heartbeat_lock);
+
+      if (!ready || heartbeat_interval <= 0) continue;
+
+      beat.put_string(HB_AGENT, name);
+      beat.put_double(HB_QPS, qps);
+      beat.put_double(HB_TARGET, target);
+      beat.put_double(HB_SHARE, probe_role ? 0 : share);
+      beat.put_u64(HB_OUTSTANDING, outstanding);
+      beat.put_double(HB_LAG, lag);
+      beat.put_u64(HB_SKIPS, skips);
+      send_msg(*sockets->pub, beat);
+    }
+  } catch (zmq::error_t &e) {
+    // The context is going away.
+  }
+
+  return NULL;
+}
+
+// MSG_BALANCE goes to the port after the heartbeats', or ".lb".
+static string balance_endpoint(const string &endpoint) {
+  string hb = heartbeat_endpoint(endpoint);
+  if (hb == endpoint + ".hb") return endpoint + ".lb";
+  return heartbeat_endpoint(hb);
+}
+
+/*
+ * --balance: the share of --qps each agent is given in lambda_denom
+ * assumes that it can keep up.  One that cannot, for a slower NIC or a
+ * busier CPU, leaves the aggregate short.  Once every agent has
+ * reported, the master caps those that are behind at what they
+ * achieve and scales up the others' lambdas, in proportion to their
+ * shares, to make up the difference.  No agent's target rises by more
+ * than BALANCE_STEP at a time, so that a capped agent that catches up
+ * is tried at a higher rate gradually rather than swinging back and
+ * forth.
+ */
+#define BALANCE_BEHIND    0.97  // Of its target, for an agent to be capped.
+#define BALANCE_TOLERANCE 0.01  // Of --qps, within which to leave it be.
+#define BALANCE_STEP      1.1   // Largest rise in an agent's target.
+
+struct agent_balance {
+  double qps;
+  double target;
+  double share;
+  bool fresh;  // Beat since the last rebalance.
+  double next; // Target to set.
+};
+
+double balance_from = 0, balance_until = 0; // When to balance; our clock.
+int balance_run = 0;    // go()s so far, for the monitor to start over.
+int balance_syncs = 0;  // sync_agent()s in this go().
+
+static void rebalance(zmq::socket_t &out, map<string, agent_balance> &agents) {
+  double want = 0, got = 0, fixed = 0;
+  vector<agent_balance*> free;
+  size_t behind = 0;
+
+  for (auto &a: agents) {
+    agent_balance &b = a.second;
+    if (b.share <= 0) continue;  // A --probe, or unpaced.
+    want += b.share;
+    got += b.qps;
+    b.next = 0;
+    if (b.qps < BALANCE_BEHIND * b.target) {
+      b.next = b.qps;
+      fixed += b.next;
+      behind++;
+    } else if (b.share > 0) {
+      free.push_back(&b);
+    }
+  }
+
+  if (want <= 0 || fabs(got - want) <= BALANCE_TOLERANCE * want) return;
+
+  // Spread what the capped agents leave over the rest by share, holding
+  // any that would rise too far at BALANCE_STEP and going again.
+  double factor = 0;
+  for (bool again = true; again && free.size();) {
+    double free_share = 0;
+    for (auto b: free) free_share += b->share;
+    factor = (want - fixed) / free_share;
+
+    again = false;
+    for (size_t i = 0; i < free.size();) {
+      agent_balance *b = free[i];
+      if (b->share * factor > b->target * BALANCE_STEP) {
+        b->next = b->target * BALANCE_STEP;
+        fixed += b->next;
+        free.erase(free.begin() + i);
+        again = true;
+      } else {
+        i++;
+      }
+    }
+  }
+  for (auto b: free) b->next = b->share * factor;
+
+  if (behind == agents.size())
+    W("--balance: every agent is behind (%.0f of %.0f QPS).", got, want);
+  else
+    V("--balance: agents at %.0f of %.0f QPS.", got, want);
+
+  for (auto &a: agents) {
+    if (a.second.share <= 0) continue;
+    AgentMessage m(MSG_BALANCE);
+    m.put_string(HB_AGENT, a.first);
+    m.put_double(BALANCE_SCALE, a.second.next / a.second.share);
+    send_msg(out, m);
+  }
+}
+
+// Master: print every agent's heartbeats as they arrive, and with
+// --balance, even out their rates.
+void* heartbeat_monitor(void *arg) {
+  try {
+    zmq::socket_t sub(context, ZMQ_SUB);
+    zmq::socket_t out(context, ZMQ_PUB);
+    int linger = 0;
+    sub.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+    sub.setsockopt(ZMQ_SUBSCRIBE, "", 0);
+    out.setsockopt(ZMQ_LINGER, &linger, sizeof(linger));
+    for (auto &endpoint: agent_endpoints) {
+      sub.connect(heartbeat_endpoint(endpoint).c_str());
+      if (args.balance_given) out.connect(balance_endpoint(endpoint).c_str());
+    }
+
+    map<string, agent_balance> agents;
+    int run = 0;
+
+    while (1) {
+      AgentMessage beat = recv_msg(sub);
+      if (beat.type() != MSG_HEARTBEAT ||
+          agent_version_check(beat.version()).size())
+        continue;
+
+      string name = beat.get_string(HB_AGENT);
+      double qps = beat.get_double(HB_QPS);
+      double target = beat.get_double(HB_TARGET);
+
+      if (args.balance_given) {
+        double now = get_time();
+        pthread_mutex_lock(&heartbeat_lock);
+        bool active = now >= balance_from && now < balance_until;
+        if (run != balance_run) agents.clear();
+        run = balance_run;
+        pthread_mutex_unlock(&heartbeat_lock);
+
+        agent_balance &a = agents[name];
+        a.qps = qps;
+        a.target = target;
+        a.share = beat.get_double(HB_SHARE, target);
+        a.fresh = true;
+
+        size_t fresh = 0;
+        for (auto &a: agents) fresh += a.second.fresh;
+        if (active && fresh >= agent_endpoints.size()) {
+          rebalance(out, agents);
+          for (auto &a: agents) a.second.fresh = false;
+        }
+      }
+
+      V("Agent %s: %.0f / %.0f QPS, %" PRIu64 " outstanding, "
+        "loop lag %.0fus, %" PRIu64 " skips", name.c_str(), qps, target,
+        beat.get_u64(HB_OUTSTANDING), beat.get_double(HB_LAG),
+        beat.get_u64(HB_SKIPS));
+
+      if (target > 0 && qps < HEARTBEAT_SHORTFALL * target)
+        W("Agent %s is behind: %.0f of its %.0f QPS.", name.c_str(), qps,
+          target);
+    }
+  } catch (zmq::error_t &e) {
+    // The context is going away.
+  }
+
+  return NULL;
+}
+
+// Agent: the rate reached unpaced for `seconds` with the run's
+// options, against a LoopbackServer standing in for each server.
+static double calibrate(const options_t &run, size_t servers, int seconds) {
+  static LoopbackServer *loopback = NULL;  // Its threads never exit.
+  if (loopback == NULL) loopback = new LoopbackServer(args.threads_arg);
+
+  options_t options = run;
+  options.qps = 0;
+  options.lambda = 0;
+  options.time = seconds;
+  options.warmup = 0;
+  options.queries = 0;
+  options.noload = true;
+  options.loadonly = false;
+  options.read_file = false;
+  options.threads = args.threads_arg;
+  vector<string> stand_in(servers, loopback->address());
+
+  // A run of our own, not synchronized with the master.
+  ConnectionStats stats;
+  args.agentmode_given = 0;
+  pthread_barrier_init(&barrier, NULL, options.threads);
+  go(stand_in, options, stats);
+  pthread_barrier_destroy(&barrier);
+  args.agentmode_given = 1;
+
+  double qps = stats.stop > stats.start ?
+    (stats.gets + stats.sets) / (stats.stop - stats.start) : 0;
+  V("Calibrated at %.0f QPS.", qps);
+  return qps;
+}
+
 /*
  * Agent protocol
  *
+ * Messages are AgentMessages (see AgentProtocol.h): versioned, with
+ * each field encoded on its own, so that master and agents need not be
+ * identical builds.  Each side checks the other's version on every
+ * message; an agent that cannot take part replies with MSG_ERROR.
+ *
  * PREPARATION PHASE
  *
- * 1. Master -> Agent: options_t
+ * 1. Master -> Agent: options_t, the servers, any --profile,
+ *    which shard of a --read_file trace to replay and the agents to
+ *    relay to (see enlist_agents())
  *
  * options_t contains most of the information needed to drive the
  * client, including the aggregate QPS that has been requested.
  * However, neither the master nor the agent know at this point how
  * many total connections will be made to the memcached server.
+ * Options the master does not send keep the agent's defaults.
  *
  * 2. Agent -> Master: int num = (--threads) * (--lambda_mul)
  *
@@ -169,54 +901,127 @@ static bool s_send (zmq::socket_t &socket, const std::string &string) {
  * [IF WARMUP]  0:  Everyone: RUN for options.warmup seconds.
  * 1. Master <-> Agent: Synchronize
  * 2. Everyone: RUN for options.time seconds.
- * 3. Master -> Agent: Dummy message
- * 4. Agent -> Master: Send AgentStats [w/ RX/TX bytes, # gets/sets]
+ * 3. Master -> Agent: Stats request
+ * 4. Agent -> Master: Send stats [w/ RX/TX bytes, # gets/sets,
+ *    latency histograms and those of each --profile step]
+ *
+ * Synchronizing measures each agent's clock against the master's and
+ * gives every client the same instant to start at; see sync_agent().
  *
  * The master then aggregates AgentStats across all agents with its
- * own ConnectionStats to compute overall statistics.
+ * own ConnectionStats to compute overall statistics, with the agents'
+ * start and stop times moved onto its own clock.
  */
 
-void agent() {
+void agent(const string &endpoint) {
   zmq::context_t context(1);
 
   zmq::socket_t socket(context, ZMQ_REP);
-  if (atoi(args.agent_port_arg) == -1) {
-    socket.bind(string("ipc:///tmp/memcached.sock").c_str());
-  } else {
-    socket.bind((string("tcp://*:")+string(args.agent_port_arg)).c_str());
-  }
+  socket.bind(endpoint.c_str());
 
-  while (true) {
-    zmq::message_t request;
+  zmq::socket_t heartbeats(context, ZMQ_PUB);
+  heartbeats.bind(heartbeat_endpoint(endpoint).c_str());
+  zmq::socket_t balance(context, ZMQ_SUB);
+  balance.setsockopt(ZMQ_SUBSCRIBE, "", 0);
+  balance.bind(balance_endpoint(endpoint).c_str());
 
-    socket.recv(&request);
+  struct heartbeat_sockets sockets = { &heartbeats, &balance };
+  pthread_t publisher;
+  if (pthread_create(&publisher, NULL, heartbeat_publisher, &sockets))
+    DIE("pthread_create() failed");
 
-    zmq::message_t num(sizeof(int));
-    *((int *) num.data()) = args.threads_arg * args.lambda_mul_arg;
-    socket.send(num);
+  while (true) {
+    AgentMessage prep = recv_msg(socket);
+
+    string why = agent_version_check(prep.version());
+    if (why.empty() && prep.type() != MSG_PREPARE)
+      why = "expected options to start a run";
+    if (why.size()) {
+      W("Master: %s", why.c_str());
+      AgentMessage error(MSG_ERROR);
+      error.put_string(ERROR_REASON, why);
+      send_msg(socket, error);
+      continue;
+    }
 
     options_t options;
-    memcpy(&options, request.data(), sizeof(options));
+    args_to_options(&options);
+    get_options(prep, &options);
 
-    vector<string> servers;
-
-    for (int i = 0; i < options.server_given; i++) {
-      servers.push_back(s_recv(socket));
-      s_send(socket, "ACK");
-    }
+    vector<string> servers = prep.get_all(PREPARE_SERVER);
+    options.server_given = servers.size();
 
     for (auto i: servers) {
       V("Got server = %s", i.c_str());
     }
 
-    options.threads = args.threads_arg;
+    trace_shard = prep.get_i64(PREPARE_TRACE_SHARD, 0);
+    trace_shards = prep.get_i64(PREPARE_TRACE_SHARDS, 1);
+    heartbeat_interval = prep.get_double(PREPARE_HEARTBEAT, 0);
+    pthread_mutex_lock(&heartbeat_lock);
+    lambda_scale = 1;
+    pthread_mutex_unlock(&heartbeat_lock);
+
+    string spec = prep.get_string(PREPARE_PROFILE);
+    delete profile;
+    profile = spec.size() ? new LoadProfile(spec, options.time) : NULL;
+
+    probe_role = prep.has(PREPARE_PROBE_QPS);
+    if (probe_role) {
+      delete profile;
+      profile = NULL;
+      options.connections = 1;
+      options.depth = 1;
+      options.qps = prep.get_i64(PREPARE_PROBE_QPS);
+    }
+
+    // As a relay, our answers cover our subtree as well as ourselves.
+    int num = probe_role ? 0 : args.threads_arg * args.lambda_mul_arg;
+    int own = agent_weight(options, servers.size(), num);
+    calibrate_time = prep.get_i64(PREPARE_CALIBRATE);
+    enlist_agents(prep.get_all(PREPARE_AGENT), prep.get_i64(PREPARE_FANOUT));
+    send_prepare(servers, options, trace_shard + 1);
+
+    calibration worst = { 0, 0, "" };
+    if (calibrate_time > 0 && own > 0 && !options.unix_socket) {
+      worst.qps = calibrate(options, servers.size(), calibrate_time);
+      worst.per_weight = worst.qps / own;
+      worst.agent = agent_name();
+    }
+
+    int weight = own + receive_prepared(servers, options);
+    for (auto &cal: agent_calibration)
+      if (cal.per_weight > 0 &&
+          (worst.per_weight <= 0 || cal.per_weight < worst.per_weight))
+        worst = cal;
+
+    AgentMessage prepared(MSG_PREPARED);
+    prepared.put_i64(PREPARED_NUM, num);
+    prepared.put_i64(PREPARED_WEIGHT, weight);
+    prepared.put_i64(PREPARED_AGENTS, 1 + agent_count());
+    prepared.put_u64(PREPARED_PROBE, probe_role);
+    if (worst.per_weight > 0) {
+      prepared.put_double(PREPARED_CAPACITY, worst.per_weight);
+      prepared.put_double(PREPARED_CAPACITY_QPS, worst.qps);
+      prepared.put_string(PREPARED_CAPACITY_AGENT, worst.agent);
+    }
+    send_msg(socket, prepared);
+
+    options.threads = probe_role ? 1 : args.threads_arg;
+    heartbeat_threads = options.threads;
 
-    socket.recv(&request);
-    options.lambda_denom = *((int *) request.data());
-    s_send(socket, "THANKS");
+    AgentMessage denom = expect_msg(socket, MSG_LAMBDA_DENOM, "agent");
+    options.lambda_denom = denom.get_i64(LAMBDA_DENOM);
+    bool abort = denom.get_u64(LAMBDA_ABORT);
+    send_lambda_denom(options.lambda_denom, abort);
+    send_msg(socket, AgentMessage(MSG_ACK));
+    if (abort) continue;
 
     //    V("AGENT SLEEPS"); sleep(1);
     options.lambda = (double) options.qps / options.lambda_denom * args.lambda_mul_arg;
+    if (probe_role)
+      options.lambda = (double) options.qps /
+        agent_weight(options, servers.size(), 1);
 
     V("lambda_denom = %d, lambda = %f, qps = %d",
       options.lambda_denom, options.lambda, options.qps);
@@ -228,23 +1033,132 @@ void agent() {
 
     go(servers, options, stats, &socket);
 
-    AgentStats as;
+    expect_msg(socket, MSG_STATS_REQ, "agent");
+    if (agent_sockets.size()) finish_agent(stats, options.threads > 0);
+
+    AgentMessage reply = encode_stats(stats);
+    for (auto &step: profile_steps)
+      reply.put_message(STAT_PROFILE_STEP, encode_stats(step.stats));
+    send_msg(socket, reply);
+  }
+}
+
+/*
+ * --local_agents: agents forked from the master on this host, each in
+ * its own process with its own CPUs and an ipc:// socket.  Past
+ * spawn_local_agents() they are enlisted agents like any other.
+ */
+vector<pid_t> local_agent_pids;
+vector<string> local_agent_paths;
+
+// A local agent that exits before the master leaves it waiting for a
+// reply forever, so give up instead.
+static void local_agent_exit_cb(int sig) {
+  static const char msg[] = "A --local_agents process exited early.\n";
+  if (write(2, msg, sizeof(msg) - 1)) {}
+  _exit(1);
+}
+
+// Split our CPUs into `parts` disjoint runs of neighbouring CPUs.  Runs
+// only share CPUs when there are fewer CPUs than parts.
+static vector<cpu_set_t> split_cpus(int parts) {
+  cpu_set_t mask;
+  CPU_ZERO(&mask);
+  if (sched_getaffinity(0, sizeof(mask), &mask))
+    DIE("sched_getaffinity() failed: %s", strerror(errno));
+
+  vector<int> cpus;
+  for (int c = 0; c < CPU_SETSIZE; c++)
+    if (CPU_ISSET(c, &mask)) cpus.push_back(c);
+
+  if ((int) cpus.size() < parts)
+    W("--local_agents: %d processes share %zu CPUs.", parts, cpus.size());
+
+  vector<cpu_set_t> sets(parts);
+  for (auto &set: sets) CPU_ZERO(&set);
+
+  int n = max((int) cpus.size(), parts);
+  for (int i = 0; i < n; i++)
+    CPU_SET(cpus[i % cpus.size()], &sets[(long) i * parts / n]);
+
+  return sets;
+}
+
+static string describe_cpus(const cpu_set_t &set) {
+  string s;
+  for (int c = 0; c < CPU_SETSIZE; c++) {
+    if (!CPU_ISSET(c, &set)) continue;
+    if (s.size()) s += ",";
+    s += to_string(c);
+  }
+  return s;
+}
+
+// Fork n agents and enlist them.  The master keeps the first share of
+// the CPUs; --affinity and --placement then choose among each
+// process's own.
+void spawn_local_agents(int n) {
+  vector<cpu_set_t> sets = split_cpus(n + 1);
+
+  for (int i = 0; i < n; i++) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/mutilate-%d-%d.sock", getpid(), i);
+    string endpoint = string("ipc://") + path;
 
-    as.rx_bytes = stats.rx_bytes;
-    as.tx_bytes = stats.tx_bytes;
-    as.gets = stats.gets;
-    as.sets = stats.sets;
-    as.get_misses = stats.get_misses;
-    as.start = stats.start;
-    as.stop = stats.stop;
-    as.skips = stats.skips;
+    pid_t pid = fork();
+    if (pid < 0) DIE("fork() failed: %s", strerror(errno));
 
-    string req = s_recv(socket);
-    //    V("req = %s", req.c_str());
-    request.rebuild(sizeof(as));
-    memcpy(request.data(), &as, sizeof(as));
-    socket.send(request);
+    if (pid == 0) {
+#ifdef __linux__
+      // Don't outlive the master, even if it dies.
+      prctl(PR_SET_PDEATHSIG, SIGKILL);
+      if (getppid() == 1) _exit(1);
+#endif
+      if (sched_setaffinity(0, sizeof(cpu_set_t), &sets[i + 1]))
+        DIE("sched_setaffinity() failed: %s", strerror(errno));
+
+      args.agentmode_given = 1;
+      args.agent_given = 0;
+      args.local_agents_given = 0;
+
+      // Our copies of the master's sockets belong to its ZMQ context,
+      // which did not survive the fork; leave them be.
+      agent_sockets.clear();
+      agent_subtrees.clear();
+      enlisted.clear();
+      agent(endpoint);
+      exit(0);
+    }
+
+    V("Local agent %d: pid %d on CPUs %s.", i, pid,
+      describe_cpus(sets[i + 1]).c_str());
+    local_agent_pids.push_back(pid);
+    local_agent_paths.push_back(path);
+
+    zmq::socket_t *s = new zmq::socket_t(context, ZMQ_REQ);
+    s->connect(endpoint.c_str());
+    agent_sockets.push_back(s);
+    agent_subtrees.push_back(vector<string>());
+    agent_endpoints.push_back(endpoint);
   }
+
+  if (sched_setaffinity(0, sizeof(cpu_set_t), &sets[0]))
+    DIE("sched_setaffinity() failed: %s", strerror(errno));
+  V("Master on CPUs %s.", describe_cpus(sets[0]).c_str());
+
+  signal(SIGCHLD, local_agent_exit_cb);
+  args.agent_given += n;
+}
+
+void stop_local_agents() {
+  signal(SIGCHLD, SIG_DFL);
+
+  for (pid_t pid: local_agent_pids) kill(pid, SIGTERM);
+  for (pid_t pid: local_agent_pids) waitpid(pid, NULL, 0);
+  for (auto &path: local_agent_paths) unlink(path.c_str());
+
+  local_agent_pids.clear();
+  local_agent_paths.clear();
 }
 
 void prep_agent(const vector<string>& servers, options_t& options) {
@@ -258,26 +1172,47 @@ void prep_agent(const vector<string>& servers, options_t& options) {
     if (options.qps) options.qps -= args.measure_qps_arg;
   }
 
-  for (auto s: agent_sockets) {
-    zmq::message_t message(sizeof(options_t));
-
-    memcpy((void *) message.data(), &options, sizeof(options_t));
-    s->send(message);
-
-    zmq::message_t rep;
-    s->recv(&rep);
-    unsigned int num = *((int *) rep.data());
-
-    sum += options.connections * (options.roundrobin ?
-            (servers.size() > num ? servers.size() : num) : 
-            (servers.size() * num));
-
-    for (auto i: servers) {
-      s_send(*s, i);
-      string rep = s_recv(*s);
+  probe_stats.clear();
+
+  pthread_mutex_lock(&heartbeat_lock);
+  balance_run++;
+  balance_syncs = 0;
+  balance_until = 0;
+  pthread_mutex_unlock(&heartbeat_lock);
+
+  // The master replays shard 0 of a trace if it has threads of its own.
+  int first_shard = options.threads > 0 ? 1 : 0;
+  trace_shard = 0;
+  trace_shards = agent_count() + first_shard;
+
+  sum += prepare_agents(servers, options, first_shard);
+
+  // How close to their --calibrate capacity the agents would run.
+  bool abort = false;
+  for (auto &cal: agent_calibration) {
+    if (cal.per_weight <= 0 || options.qps <= 0) continue;
+
+    double load = options.qps / (cal.per_weight * sum);
+    if (load > 1) {
+      W("Agent %s would need %.0f%% of the %.0f QPS it reached in "
+        "calibration; refusing to run.", cal.agent.c_str(), load * 100,
+        cal.qps);
+      abort = true;
+    } else if (load > args.calibrate_max_arg) {
+      W("Agent %s would run at %.0f%% of the %.0f QPS it reached in "
+        "calibration; its latency may not be trustworthy.",
+        cal.agent.c_str(), load * 100, cal.qps);
+    } else {
+      V("Agent %s would run at %.0f%% of its %.0f QPS capacity.",
+        cal.agent.c_str(), load * 100, cal.qps);
     }
   }
 
+  if (abort) {
+    send_lambda_denom(sum, true);
+    DIE("Lower --qps or add agents, threads or connections.");
+  }
+
   // Adjust options_t according to --measure_* arguments.
   options.lambda_denom = sum;
   options.lambda = (double) options.qps / options.lambda_denom *
@@ -297,12 +1232,7 @@ void prep_agent(const vector<string>& servers, options_t& options) {
 
   if (args.measure_depth_given) options.depth = args.measure_depth_arg;
 
-  for (auto s: agent_sockets) {
-    zmq::message_t message(sizeof(sum));
-    *((int *) message.data()) = sum;
-    s->send(message);
-    string rep = s_recv(*s);
-  }
+  send_lambda_denom(sum);
 
   // Master sleeps here to give agents a chance to connect to
   // memcached server before the master, so that the master is never
@@ -311,73 +1241,197 @@ void prep_agent(const vector<string>& servers, options_t& options) {
   V("MASTER SLEEPS"); sleep_time(1.5);
 }
 
-void finish_agent(ConnectionStats &stats) {
-  for (auto s: agent_sockets) {
-    s_send(*s, "stats");
+void finish_agent(ConnectionStats &stats, bool master_ran) {
+  double min_start = stats.start, max_start = stats.start;
+  double min_stop = stats.stop, max_stop = stats.stop;
+  bool first = !master_ran;
+
+  for (size_t i = 0; i < agent_sockets.size(); i++) {
+    zmq::socket_t *s = agent_sockets[i];
+    send_msg(*s, AgentMessage(MSG_STATS_REQ));
 
     AgentStats as;
-    zmq::message_t message;
+    AgentMessage reply = expect_msg(*s, MSG_STATS, "finish_agent");
+    auto probe = probe_names.find(s);
+    ConnectionStats *latency = probe == probe_names.end() ? NULL :
+      &probe_stats[probe->second];
+    decode_stats(reply, &as, latency);
+
+    double offset = i < agent_offsets.size() ? agent_offsets[i] : 0;
+    as.start -= offset;
+    as.stop -= offset;
+    if (latency) latency->accumulate(as);
+
+    // The agent's share of each --profile step.
+    vector<string> steps = reply.get_all(STAT_PROFILE_STEP);
+    if (profile_steps.size() < steps.size())
+      profile_steps.resize(steps.size());
+    for (size_t j = 0; j < steps.size(); j++) {
+      AgentStats step;
+      ConnectionStats &merged = profile_steps[j].stats;
+      decode_stats(AgentMessage(steps[j].data(), steps[j].size()), &step,
+                   &merged);
+      step.start -= offset;
+      step.stop -= offset;
+      merged.accumulate(step);
+    }
+
+    if (first || as.start < min_start) min_start = as.start;
+    if (first || as.start > max_start) max_start = as.start;
+    if (first || as.stop < min_stop) min_stop = as.stop;
+    if (first || as.stop > max_stop) max_stop = as.stop;
+    first = false;
 
-    s->recv(&message);
-    memcpy(&as, message.data(), sizeof(as));
     stats.accumulate(as);
   }
+
+  if (agent_offsets.size())
+    V("Agent start skew %.1fus, stop skew %.1fus.",
+      (max_start - min_start) * 1000000, (max_stop - min_stop) * 1000000);
 }
 
 /*
- * This synchronization routine is ridiculous because the master only
- * has a ZMQ_REQ socket to the agents, but it needs to wait for a
- * message from each agent before it releases them.  In order to get
- * the ZMQ socket into a state where it'll allow the agent to send it
- * a message, it must first send a message ("sync_req").  In order to
- * not leave the socket dangling with an incomplete transaction, the
- * agent must send a reply ("ack").
- *
- * Without this stupid complication it would be:
+ * One agent's clock less ours, from the SYNC_PINGS reading with the
+ * shortest round trip, taken to be halfway through it.
+ */
+static double clock_offset(zmq::socket_t *s, double *rtt) {
+  double offset = 0;
+  *rtt = -1;
+
+  for (int i = 0; i < SYNC_PINGS; i++) {
+    double t0 = get_time();
+    send_msg(*s, AgentMessage(MSG_TIME_REQ));
+    double remote =
+      expect_msg(*s, MSG_TIME, "sync_agent[M]").get_double(TIME_NOW);
+    double t1 = get_time();
+
+    if (*rtt < 0 || t1 - t0 < *rtt) {
+      *rtt = t1 - t0;
+      offset = remote - (t0 + t1) / 2;
+    }
+  }
+
+  return offset;
+}
+
+/*
+ * The master only has a ZMQ_REQ socket to the agents, but it needs to
+ * wait for a message from each agent before it releases them.  In
+ * order to get the ZMQ socket into a state where it'll allow the agent
+ * to send it a message, it must first send a message (MSG_SYNC_REQ).
  *
  * For each agent:
- *   Agent -> Master: sync
+ *   Master -> Agent: MSG_SYNC_REQ
+ *   Agent -> Master: MSG_SYNC (once all its threads are ready)
+ * For each agent, SYNC_PINGS times:
+ *   Master -> Agent: MSG_TIME_REQ
+ *   Agent -> Master: MSG_TIME, its get_time()
  * For each agent:
- *   Master -> Agent: proceed
+ *   Master -> Agent: MSG_START, the instant on the agent's clock
+ *   Agent -> Master: MSG_ACK
  *
- * In this way, all agents must arrive at the barrier and the master
- * must receive a message from each of them before it continues.  It
- * then broadcasts the message to proceed, which reasonably limits
- * skew.
+ * Rather than releasing agents one message at a time, so that each
+ * starts a round trip later than the one before, the master estimates
+ * every agent's clock offset NTP-style and sends all of them the same
+ * instant, far enough ahead that the last one hears of it in time.
+ * Returns that instant on the local clock; each thread waits for it.
+ *
+ * A relay does the same with its own agents between MSG_SYNC_REQ and
+ * MSG_SYNC, and passes MSG_START on with their offsets; its MSG_SYNC
+ * says how much longer that makes the start's way down its subtree.
  */
 
-void sync_agent(zmq::socket_t* socket) {
+// Wait for the agents we talk to, and their subtrees, to be ready and
+// measure their clocks.  Returns how far ahead to set the start.
+static double sync_agents_ready() {
+  double subtree_lead = 0;
+
+  for (auto s: agent_sockets)
+    send_msg(*s, AgentMessage(MSG_SYNC_REQ));
+
+  for (auto s: agent_sockets) {
+    AgentMessage ready = expect_msg(*s, MSG_SYNC, "sync_agent[M]");
+    subtree_lead = max(subtree_lead, ready.get_double(SYNC_LEAD));
+  }
+
+  double max_rtt = 0;
+  agent_offsets.resize(agent_sockets.size());
+  for (size_t i = 0; i < agent_sockets.size(); i++) {
+    double rtt;
+    agent_offsets[i] = clock_offset(agent_sockets[i], &rtt);
+    if (rtt > max_rtt) max_rtt = rtt;
+    D("Agent %zu: clock offset %.1fus, rtt %.1fus", i,
+      agent_offsets[i] * 1000000, rtt * 1000000);
+  }
+
+  // Starts are sent to all agents before waiting on any of their acks.
+  return 2 * max_rtt * agent_sockets.size() + subtree_lead;
+}
+
+// Give the agents we talk to `start`, on our clock.
+static void start_agents(double start) {
+  for (size_t i = 0; i < agent_sockets.size(); i++) {
+    AgentMessage m(MSG_START);
+    m.put_double(START_AT, start + agent_offsets[i]);
+    send_msg(*agent_sockets[i], m);
+  }
+
+  for (auto s: agent_sockets)
+    expect_msg(*s, MSG_ACK, "sync_agent[M]");
+}
+
+double sync_agent(zmq::socket_t* socket) {
   //  V("agent: synchronizing");
+  double start = get_time();
 
   if (args.agent_given) {
-    for (auto s: agent_sockets)
-      s_send(*s, "sync_req");
-
-    /* The real sync */
-    for (auto s: agent_sockets)
-      if (s_recv(*s).compare(string("sync")))
-        DIE("sync_agent[M]: out of sync [1]");
-    for (auto s: agent_sockets)
-      s_send(*s, "proceed");
-    /* End sync */
-
-    for (auto s: agent_sockets)
-      if (s_recv(*s).compare(string("ack")))
-        DIE("sync_agent[M]: out of sync [2]");
+    double lead = sync_agents_ready();
+    start = get_time() + (lead > SYNC_MIN_LEAD ? lead : SYNC_MIN_LEAD);
+    start_agents(start);
+
+    // The first sync of a go() starts the warmup, if any.
+    pthread_mutex_lock(&heartbeat_lock);
+    balance_from = start;
+    if (args.balance_given && !strcmp(args.balance_arg, "run"))
+      balance_until = start + args.warmup_arg + args.time_arg;
+    else if (args.balance_given && balance_syncs == 0)
+      balance_until = start + args.warmup_arg;
+    else
+      balance_until = 0;
+    balance_syncs++;
+    pthread_mutex_unlock(&heartbeat_lock);
   } else if (args.agentmode_given) {
-    if (s_recv(*socket).compare(string("sync_req")))
-      DIE("sync_agent[A]: out of sync [1]");
+    expect_msg(*socket, MSG_SYNC_REQ, "sync_agent[A]");
+
+    AgentMessage ready(MSG_SYNC);
+    if (agent_sockets.size())
+      ready.put_double(SYNC_LEAD, sync_agents_ready());
+    send_msg(*socket, ready);
 
-    /* The real sync */
-    s_send(*socket, "sync");
-    if (s_recv(*socket).compare(string("proceed")))
-      DIE("sync_agent[A]: out of sync [2]");
-    /* End sync */
+    while (1) {
+      AgentMessage req = recv_msg(*socket);
+
+      if (req.type() == MSG_TIME_REQ) {
+        AgentMessage now(MSG_TIME);
+        now.put_double(TIME_NOW, get_time());
+        send_msg(*socket, now);
+      } else if (req.type() == MSG_START) {
+        start = req.get_double(START_AT);
+        if (agent_sockets.size()) start_agents(start);
+        send_msg(*socket, AgentMessage(MSG_ACK));
+        break;
+      } else {
+        DIE("sync_agent[A]: out of sync (message %d)", req.type());
+      }
+    }
 
-    s_send(*socket, "ack");
+    if (start < get_time())
+      W("Agent start instant already %.1fus past.",
+        (get_time() - start) * 1000000);
   }
 
   //  V("agent: synchronized");
+  return start;
 }
 #endif
 
@@ -451,17 +1505,66 @@ int main(int argc, char **argv) {
   //  if (args.valuesize_arg < 1 || args.valuesize_arg > 1024*1024)
   //    DIE("--valuesize must be >= 1 and <= 1024*1024");
   if (args.qps_arg < 0) DIE("--qps must be >= 0");
+  if (args.imbalance_arg <= 1.0) DIE("--imbalance must be > 1.0");
+#ifndef __linux__
+  if (args.kernel_timestamps_given)
+    DIE("--kernel_timestamps requires Linux SO_TIMESTAMPING");
+#endif
+  if (args.kernel_timestamps_given && args.unix_socket_given)
+    DIE("--kernel_timestamps is not supported with --unix_socket");
+  if (args.kernel_timestamps_given && strcmp(args.engine_arg, "libevent"))
+    DIE("--kernel_timestamps requires --engine=libevent");
+  if (args.placement_given && args.affinity_given)
+    DIE("--placement and --affinity both choose thread CPUs; pick one");
+  if (!strcmp(args.placement_arg, "nic") && !args.nic_given)
+    DIE("--placement=nic requires --nic");
+  if (args.local_agents_given && args.local_agents_arg < 1)
+    DIE("--local_agents must be >= 1");
+  if (args.agent_fanout_arg < 0) DIE("--agent_fanout must be >= 0");
+  if (args.probe_qps_arg < 1) DIE("--probe_qps must be >= 1");
+  if (args.calibrate_arg < 0) DIE("--calibrate must be >= 0");
+  if (args.calibrate_max_arg <= 0) DIE("--calibrate_max must be > 0");
+  if (args.probe_given && args.read_file_given)
+    DIE("--probe agents do not replay --read_file traces");
+  if (args.probe_given && args.agentmode_given)
+    DIE("--probe is for the master, not --agentmode");
+  if (args.heartbeat_arg < 0) DIE("--heartbeat must be >= 0");
+  if (args.balance_given && !args.agent_given && !args.local_agents_given)
+    DIE("--balance needs agents to balance");
+  if (args.balance_given && args.heartbeat_arg <= 0)
+    DIE("--balance works from heartbeats; --heartbeat must be > 0");
+  if (args.balance_given && !strcmp(args.balance_arg, "warmup") &&
+      args.warmup_arg <= 0)
+    DIE("--balance=warmup needs a --warmup");
+  if (args.local_agents_given && args.agentmode_given)
+    DIE("--local_agents is for the master, not --agentmode");
+#ifndef HAVE_LIBZMQ
+  if (args.agent_given || args.agentmode_given || args.local_agents_given)
+    DIE("Agents require a build with ZeroMQ");
+#endif
+  if (args.loopback_given &&
+      (args.agent_given || args.agentmode_given || args.local_agents_given ||
+       args.probe_given))
+    DIE("--loopback cannot be combined with agents");
+  if (args.loopback_given && args.unix_socket_given)
+    DIE("--loopback is not supported with --unix_socket");
   if (args.update_arg < 0.0 || args.update_arg > 1.0)
     DIE("--update must be >= 0.0 and <= 1.0");
   if (args.time_arg < 1) DIE("--time must be >= 1");
   //  if (args.keysize_arg < MINIMUM_KEY_LENGTH)
   //    DIE("--keysize must be >= %d", MINIMUM_KEY_LENGTH);
+  if (args.hotkeys_arg < 0) DIE("--hotkeys must be >= 0");
   if (args.connections_arg < 1 || args.connections_arg > MAXIMUM_CONNECTIONS)
     DIE("--connections must be between [1,%d]", MAXIMUM_CONNECTIONS);
   //  if (get_distribution(args.iadist_arg) == -1)
   //    DIE("--iadist invalid: %s", args.iadist_arg);
-  if (!args.server_given && !args.agentmode_given)
-    DIE("--server or --agentmode must be specified.");
+  if (!args.server_given && !args.agentmode_given && !args.loopback_given)
+    DIE("--server, --loopback or --agentmode must be specified.");
+  if (args.profile_given && (args.scan_given || args.search_given))
+    DIE("--profile cannot be combined with --scan or --search");
+  if (args.profile_interval_arg <= 0) DIE("--profile_interval must be > 0");
+  if (args.profile_given) profile = new LoadProfile(args.profile_arg,
+                                                    args.time_arg);
 
   // TODO: Discover peers, share arguments.
 
@@ -478,16 +1581,41 @@ int main(int argc, char **argv) {
 
 #ifdef HAVE_LIBZMQ
   if (args.agentmode_given) {
-    agent();
+    if (atoi(args.agent_port_arg) == -1)
+      agent("ipc:///tmp/memcached.sock");
+    else
+      agent(string("tcp://*:") + args.agent_port_arg);
     return 0;
-  } else if (args.agent_given) {
-    for (unsigned int i = 0; i < args.agent_given; i++) {
-      zmq::socket_t *s = new zmq::socket_t(context, ZMQ_REQ);
-      string host = string("tcp://") + string(args.agent_arg[i]) +
+  } else if (args.agent_given || args.local_agents_given ||
+             args.probe_given) {
+    vector<string> endpoints;
+    for (unsigned int i = 0; i < args.agent_given; i++)
+      endpoints.push_back(string("tcp://") + string(args.agent_arg[i]) +
+                          string(":") + string(args.agent_port_arg));
+    enlist_agents(endpoints, args.agent_fanout_arg);
+    agent_endpoints = endpoints;
+
+    // Probes are outside the tree, so that each reports on its own.
+    for (unsigned int i = 0; i < args.probe_given; i++) {
+      string endpoint = string("tcp://") + string(args.probe_arg[i]) +
         string(":") + string(args.agent_port_arg);
-      s->connect(host.c_str());
+      zmq::socket_t *s = new zmq::socket_t(context, ZMQ_REQ);
+      s->connect(endpoint.c_str());
       agent_sockets.push_back(s);
+      agent_subtrees.push_back(vector<string>());
+      agent_endpoints.push_back(endpoint);
+      probe_names[s] = args.probe_arg[i];
     }
+    args.agent_given += args.probe_given;
+
+    if (args.local_agents_given) spawn_local_agents(args.local_agents_arg);
+
+    heartbeat_interval = args.heartbeat_arg;
+    calibrate_time = args.calibrate_arg;
+    pthread_t monitor;
+    if (heartbeat_interval > 0 &&
+        pthread_create(&monitor, NULL, heartbeat_monitor, NULL))
+      DIE("pthread_create() failed");
   }
 #endif
 
@@ -505,6 +1633,12 @@ int main(int argc, char **argv) {
     }
   }
 
+  if (args.loopback_given) {
+    // Serves until exit, across every run of --scan or --search.
+    LoopbackServer *loopback = new LoopbackServer(options.threads);
+    servers.push_back(loopback->address());
+  }
+
   ConnectionStats stats;
 
   double peak_qps = 0.0;
@@ -525,7 +1659,7 @@ int main(int argc, char **argv) {
     double nth;
     int cur_qps;
 
-    go(servers, options, stats);
+    go_step(servers, options, stats);
 
     nth = stats.get_nth(n);
     peak_qps = stats.get_qps();
@@ -546,7 +1680,7 @@ int main(int argc, char **argv) {
 
       stats = ConnectionStats();
 
-      go(servers, options, stats);
+      go_step(servers, options, stats);
 
       nth = stats.get_nth(n);
 
@@ -568,7 +1702,7 @@ int main(int argc, char **argv) {
 
       stats = ConnectionStats();
 
-      go(servers, options, stats);
+      go_step(servers, options, stats);
 
       nth = stats.get_nth(n);
 
@@ -603,7 +1737,7 @@ int main(int argc, char **argv) {
 
       stats = ConnectionStats();
 
-      go(servers, options, stats);
+      go_step(servers, options, stats);
 
       stats.print_stats("read", stats.get_sampler, false);
       printf(" %8.1f", stats.get_qps());
@@ -611,16 +1745,29 @@ int main(int argc, char **argv) {
     }    
   } else {
     go(servers, options, stats);
+    if (profile) print_profile();
   }
 
+  pool_stop();
+
   if (!args.scan_given && !args.loadonly_given) {
     stats.print_header();
     stats.print_stats("read",   stats.get_sampler);
     stats.print_stats("update", stats.set_sampler);
     stats.print_stats("op_q",   stats.op_sampler);
+    if (args.wire_timestamps_given) {
+      stats.print_stats("txwait", stats.txwait_sampler);
+      stats.print_stats("net+srv", stats.wire_sampler);
+    }
+    if (args.kernel_timestamps_given) {
+      stats.print_stats("kclient", stats.kclient_sampler);
+      stats.print_stats("knet", stats.knet_sampler);
+    }
 
     int total = stats.gets + stats.sets;
 
+    if (probe_stats.size()) print_probes();
+
     printf("\nTotal QPS = %.1f (%d / %.1fs)\n",
            total / (stats.stop - stats.start),
            total, stats.stop - stats.start);
@@ -654,6 +1801,28 @@ int main(int argc, char **argv) {
         fprintf(file, "%f %f\n", i.start_time - boot_time, i.time());
       }
     }
+
+    report_server_stats(args.server_stats_given || args.connection_stats_given);
+
+    if (stats.hot_ops.enabled()) {
+      printf("\n");
+      stats.print_hotkeys("#hotkey(ops)", stats.hot_ops, args.hotkeys_arg);
+      printf("\n");
+      stats.print_hotkeys("#hotkey(bytes)", stats.hot_bytes, args.hotkeys_arg);
+
+      if (args.save_hotkeys_given) {
+        printf("Saving hot key stats to %s.\n", args.save_hotkeys_arg);
+
+        FILE *file;
+        if ((file = fopen(args.save_hotkeys_arg, "w")) == NULL)
+          DIE("--save_hotkeys: failed to open %s: %s",
+              args.save_hotkeys_arg, strerror(errno));
+
+        stats.save_hotkeys(file, "ops", stats.hot_ops, args.hotkeys_arg);
+        stats.save_hotkeys(file, "bytes", stats.hot_bytes, args.hotkeys_arg);
+        fclose(file);
+      }
+    }
   }
 
   //  if (args.threads_arg > 1) 
@@ -662,6 +1831,7 @@ int main(int argc, char **argv) {
 #ifdef HAVE_LIBZMQ
   if (args.agent_given) {
     for (auto i: agent_sockets) delete i;
+    stop_local_agents();
   }
 #endif
 
@@ -683,9 +1853,13 @@ void go(const vector<string>& servers, options_t& options,
   }
 #endif
 
+  server_stats.clear();
+  profile_steps.clear();
+
   ConcurrentQueue<string> *trace_queue = new ConcurrentQueue<string>(20000000);
-  struct reader_data *rdata = (struct reader_data*)malloc(sizeof(struct reader_data));
+  struct reader_data *rdata = new reader_data;
   rdata->trace_queue = trace_queue;
+  rdata->twitter_trace = options.twitter_trace;
   pthread_t rtid;
   if (options.read_file) {
       rdata->trace_filename = options.file_name; 
@@ -697,16 +1871,12 @@ void go(const vector<string>& servers, options_t& options,
       
   }
 
-  /* initialize item locks */
-  uint32_t item_lock_count = hashsize(item_lock_hashpower);
-  item_locks = (pthread_mutex_t*)calloc(item_lock_count, sizeof(pthread_mutex_t));
-  for (size_t i = 0; i < item_lock_count; i++) {
-      pthread_mutex_init(&item_locks[i], NULL);
-  }
+  init_item_locks();
 
 
   if (options.threads > 1) {
     struct thread_data td[options.threads];
+    vector< map<string, ConnectionStats> > thread_server_stats(options.threads);
 #ifdef __clang__
     vector<string>* ts = static_cast<vector<string>*>(alloca(sizeof(vector<string>) * options.threads));
 #else
@@ -715,6 +1885,7 @@ void go(const vector<string>& servers, options_t& options,
 
 #ifdef __linux__
     int current_cpu = -1;
+    vector<int> placement = plan_placement(options.threads);
 #endif
 
 
@@ -722,6 +1893,7 @@ void go(const vector<string>& servers, options_t& options,
       td[t].options = &options;
       td[t].id = t;
       td[t].trace_queue = trace_queue;
+      td[t].server_stats = &thread_server_stats[t];
 #ifdef HAVE_LIBZMQ
       td[t].socket = socket;
 #endif
@@ -742,27 +1914,7 @@ void go(const vector<string>& servers, options_t& options,
       pthread_attr_init(&attr);
 
 #ifdef __linux__
-      if (args.affinity_given) {
-        int max_cpus = 8 * sizeof(cpu_set_t);
-        cpu_set_t m;
-        CPU_ZERO(&m);
-        sched_getaffinity(0, sizeof(cpu_set_t), &m);
-
-        for (int i = 0; i < max_cpus; i++) {
-          int c = (current_cpu + i + 1) % max_cpus;
-          if (CPU_ISSET(c, &m)) {
-            CPU_ZERO(&m);
-            CPU_SET(c, &m);
-            int ret;
-            if ((ret = pthread_attr_setaffinity_np(&attr,
-                                                   sizeof(cpu_set_t), &m)))
-              DIE("pthread_attr_setaffinity_np(%d) failed: %s",
-                  c, strerror(ret));
-            current_cpu = c;
-            break;
-          }
-        }
-      }
+      place_thread(&attr, placement, t, current_cpu);
 #endif
 
       if (pthread_create(&pt[t], &attr, thread_main, &td[t]))
@@ -773,49 +1925,203 @@ void go(const vector<string>& servers, options_t& options,
     for (int t = 0; t < options.threads; t++) {
       ConnectionStats *cs;
       if (pthread_join(pt[t], (void**) &cs)) DIE("pthread_join() failed");
+      report_loop_lag(t, *cs);
       stats.accumulate(*cs);
       delete cs;
+
+      for (auto &s: thread_server_stats[t])
+        server_stats[s.first].accumulate(s.second);
     }
     delete trace_queue;
 
-  } else if (options.threads == 1) {
-    do_mutilate(servers, options, stats, trace_queue, true
-#ifdef HAVE_LIBZMQ
-, socket
+  } else if (options.threads == 1) {
+#ifdef __linux__
+    // "cores" never pinned a lone thread, so only the topology modes do.
+    // This is the main thread, so put it back afterwards: later --scan
+    // steps and the threads they create would inherit the one CPU.
+    cpu_set_t saved;
+    bool pinned = false;
+    if (strcmp(args.placement_arg, "cores")) {
+      vector<int> placement = plan_placement(1);
+      if (placement.size() > 0) {
+        cpu_set_t m;
+        CPU_ZERO(&m);
+        CPU_SET(placement[0], &m);
+        if (sched_getaffinity(0, sizeof(cpu_set_t), &saved))
+          DIE("sched_getaffinity() failed: %s", strerror(errno));
+        if (sched_setaffinity(0, sizeof(cpu_set_t), &m))
+          DIE("sched_setaffinity(%d) failed: %s",
+              placement[0], strerror(errno));
+        pinned = true;
+      }
+    }
+#endif
+    do_mutilate(servers, options, stats, server_stats, trace_queue, true
+#ifdef HAVE_LIBZMQ
+, socket
+#endif
+);
+#ifdef __linux__
+    if (pinned && sched_setaffinity(0, sizeof(cpu_set_t), &saved))
+      DIE("sched_setaffinity() failed: %s", strerror(errno));
+#endif
+    report_loop_lag(0, stats);
+  } else {
+#ifdef HAVE_LIBZMQ
+    if (args.agent_given) {
+      sync_agent(socket);
+    }
+#endif
+  }
+
+#ifdef HAVE_LIBZMQ
+  if (args.agent_given > 0) {
+    int total = stats.gets + stats.sets;
+
+    V("Local QPS = %.1f (%d / %.1fs)",
+      total / (stats.stop - stats.start),
+      total, stats.stop - stats.start);    
+
+    finish_agent(stats, options.threads > 0);
+  }
+#endif
+}
+
+/* initialize item locks, once for every go() */
+void init_item_locks() {
+  if (item_locks != NULL) return;
+
+  uint32_t item_lock_count = hashsize(item_lock_hashpower);
+  item_locks = (pthread_mutex_t*)calloc(item_lock_count, sizeof(pthread_mutex_t));
+  for (size_t i = 0; i < item_lock_count; i++) {
+      pthread_mutex_init(&item_locks[i], NULL);
+  }
+}
+
+/*
+ * Worker pool for --scan and --search.  go() starts threads, connects
+ * and loads the database all over again for every step; the pool does
+ * that once, then only hands each thread the step's options between
+ * two barriers.  Steps take seconds of setup instead of minutes and no
+ * longer measure freshly opened connections.
+ */
+struct pool_thread {
+  int id;
+  pthread_t thread;
+  const vector<string> *servers;
+  options_t options; // The current step's.
+  ConnectionStats stats;
+  map<string, ConnectionStats> server_stats;
+};
+
+vector<pool_thread*> pool;
+pthread_barrier_t pool_barrier; // Pool threads plus the main thread.
+bool pool_exit = false;
+
+void* pool_main(void *arg) {
+  struct pool_thread *pt = (struct pool_thread *) arg;
+  struct worker w;
+
+  worker_setup(w, *pt->servers, pt->options, NULL);
+
+  while (1) {
+    pthread_barrier_wait(&pool_barrier); // Next step's options are set.
+    if (pool_exit) break;
+
+    w.context->set_lambda(pt->options.lambda);
+
+    worker_run(w, pt->options, pt->stats, pt->server_stats, pt->id == 0);
+    worker_drain(w);
+
+    pthread_barrier_wait(&pool_barrier); // Step's stats are in.
+  }
+
+  worker_teardown(w);
+  return NULL;
+}
+
+void pool_go(const vector<string>& servers, options_t& options,
+             ConnectionStats &stats) {
+  server_stats.clear();
+  init_item_locks();
+
+  if (pool.size() == 0) {
+    pthread_barrier_init(&pool_barrier, NULL, options.threads + 1);
+
+#ifdef __linux__
+    int current_cpu = -1;
+    vector<int> placement;
+    if (options.threads > 1 || strcmp(args.placement_arg, "cores"))
+      placement = plan_placement(options.threads);
+#endif
+
+    for (int t = 0; t < options.threads; t++) {
+      struct pool_thread *pt = new pool_thread();
+      pt->id = t;
+      pt->servers = &servers;
+      pt->options = options;
+      pool.push_back(pt);
+
+      pthread_attr_t attr;
+      pthread_attr_init(&attr);
+#ifdef __linux__
+      place_thread(&attr, placement, t, current_cpu);
 #endif
-);
+
+      if (pthread_create(&pt->thread, &attr, pool_main, pt))
+        DIE("pthread_create() failed");
+    }
   } else {
-#ifdef HAVE_LIBZMQ
-    if (args.agent_given) {
-      sync_agent(socket);
+    for (pool_thread *pt: pool) {
+      pt->options = options;
+      pt->stats = ConnectionStats();
+      pt->server_stats.clear();
     }
-#endif
   }
 
-#ifdef HAVE_LIBZMQ
-  if (args.agent_given > 0) {
-    int total = stats.gets + stats.sets;
+  pthread_barrier_wait(&pool_barrier);
+  pthread_barrier_wait(&pool_barrier);
 
-    V("Local QPS = %.1f (%d / %.1fs)",
-      total / (stats.stop - stats.start),
-      total, stats.stop - stats.start);    
+  for (pool_thread *pt: pool) {
+    report_loop_lag(pt->id, pt->stats);
+    stats.accumulate(pt->stats);
 
-    finish_agent(stats);
+    for (auto &s: pt->server_stats)
+      server_stats[s.first].accumulate(s.second);
   }
-#endif
 }
 
-int stick_this_thread_to_core(int core_id) {
-   int num_cores = sysconf(_SC_NPROCESSORS_ONLN);
-   if (core_id < 0 || core_id >= num_cores)
-      return EINVAL;
+void pool_stop() {
+  if (pool.size() == 0) return;
+
+  pool_exit = true;
+  pthread_barrier_wait(&pool_barrier);
+
+  for (pool_thread *pt: pool) {
+    if (pthread_join(pt->thread, NULL)) DIE("pthread_join() failed");
+    delete pt;
+  }
+
+  pool.clear();
+  pthread_barrier_destroy(&pool_barrier);
+}
 
-   cpu_set_t cpuset;
-   CPU_ZERO(&cpuset);
-   CPU_SET(core_id, &cpuset);
+/*
+ * One step of --scan or --search.  The pool cannot replay a --trace
+ * (go() reads it afresh for each run), and agents expect a new round
+ * per step, so those still go through go().
+ */
+void go_step(const vector<string>& servers, options_t& options,
+             ConnectionStats &stats) {
+#ifdef HAVE_LIBZMQ
+  if (args.agent_given) {
+    go(servers, options, stats);
+    return;
+  }
+#endif
 
-   pthread_t current_thread = pthread_self();    
-   return pthread_setaffinity_np(current_thread, sizeof(cpu_set_t), &cpuset);
+  if (options.read_file) go(servers, options, stats);
+  else pool_go(servers, options, stats);
 }
 
 bool hasEnding (string const &fullString, string const &ending) {
@@ -897,9 +2203,32 @@ static char *get_stream(ZSTD_DCtx* dctx, FILE *fin, size_t const buffInSize, voi
 
 }
 
+/*
+ * Whether a trace line belongs to this client's shard: by the hash of
+ * its key, which is the second field of --twitter_trace 1 lines and
+ * the fourth otherwise.
+ */
+static bool in_trace_shard(const string &line, int twitter_trace) {
+  if (trace_shards <= 1) return true;
+
+  int field = twitter_trace == 1 ? 1 : 3;
+  size_t from = 0;
+  for (int i = 0; i < field && from != string::npos; i++) {
+    from = line.find(',', from);
+    if (from != string::npos) from++;
+  }
+  if (from == string::npos) return trace_shard == 0;
+
+  size_t to = line.find(',', from);
+  if (to == string::npos) to = line.size();
+  return fnv_64_buf(line.data() + from, to - from) % trace_shards ==
+    (uint64_t) trace_shard;
+}
+
 void* reader_thread(void *arg) {
   struct reader_data *rdata = (struct reader_data *) arg;
   ConcurrentQueue<string> *trace_queue = (ConcurrentQueue<string>*) rdata->trace_queue;
+  uint64_t kept = 0, total = 0;
  
   if (hasEnding(rdata->trace_filename,".zst")) {
         //init
@@ -925,6 +2254,9 @@ void* reader_thread(void *arg) {
             while ((line = strsep(&trace,"\n"))) {
                 strncpy(line_p,line,2048);
                 string full_line(line);
+                total++;
+                if (!in_trace_shard(full_line, rdata->twitter_trace)) continue;
+                kept++;
                 bool res = trace_queue->try_enqueue(full_line);
                 while (!res) {
                     usleep(10);
@@ -959,6 +2291,9 @@ void* reader_thread(void *arg) {
   	while (trace_file.good()) {
   	  string line;
   	  getline(trace_file,line);
+  	  total++;
+  	  if (!in_trace_shard(line, rdata->twitter_trace)) continue;
+  	  kept++;
   	  trace_queue->enqueue(line);
   	}
   	string eof = "EOF";
@@ -967,20 +2302,19 @@ void* reader_thread(void *arg) {
   	}
   }
 
+  if (trace_shards > 1)
+    V("Trace shard %d of %d: %" PRIu64 " of %" PRIu64 " lines.",
+      trace_shard, trace_shards, kept, total);
+
   return NULL;
 }
 
 void* thread_main(void *arg) {
   struct thread_data *td = (struct thread_data *) arg;
-  int num_cores = sysconf(_SC_NPROCESSORS_ONLN);
-  int res = stick_this_thread_to_core(td->id % num_cores);
-  if (res != 0) {
-        DIE("pthread_attr_setaffinity_np(%d) failed: %s",
-                  td->id, strerror(res));
-  }
   ConnectionStats *cs = new ConnectionStats();
 
-  do_mutilate(*td->servers, *td->options, *cs,  td->trace_queue, td->master
+  do_mutilate(*td->servers, *td->options, *cs, *td->server_stats,
+              td->trace_queue, td->master
 #ifdef HAVE_LIBZMQ
 , td->socket
 #endif
@@ -990,42 +2324,211 @@ void* thread_main(void *arg) {
 }
 
 void do_mutilate(const vector<string>& servers, options_t& options,
-                 ConnectionStats& stats, ConcurrentQueue<string> *trace_queue, bool master 
+                 ConnectionStats& stats, map<string, ConnectionStats>& server_stats,
+                 ConcurrentQueue<string> *trace_queue, bool master 
 #ifdef HAVE_LIBZMQ
 , zmq::socket_t* socket
 #endif
 ) {
-  int loop_flag =
-    (options.blocking || args.blocking_given) ? EVLOOP_ONCE : EVLOOP_NONBLOCK;
+  struct worker w;
+
+  worker_setup(w, servers, options, trace_queue);
+
+  if (!options.loadonly)
+    worker_run(w, options, stats, server_stats, master
+#ifdef HAVE_LIBZMQ
+, socket
+#endif
+);
+
+  worker_teardown(w);
+}
+
+// Non-blocking connection setup for worker_setup(): at most
+// --connect_inflight connects at a time, and failed ones are retried
+// from a timer with exponential backoff (doubling from CONNECT_BACKOFF
+// up to CONNECT_BACKOFF_MAX, randomized by +-50%) rather than sleep().
+// An attempt still unresolved after --connect_timeout counts as failed.
+#define CONNECT_BACKOFF     0.1
+#define CONNECT_BACKOFF_MAX 10.0
+
+struct connector {
+  int inflight;
+  int resolved; // Connected or given up on.
+  int retries;
+  deque<struct pending_connect*> waiting;
+  vector<double> latency; // Seconds, of attempts that succeeded.
+  unsigned short jitter[3]; // erand48() state for backoff jitter.
+
+  connector() : inflight(0), resolved(0), retries(0) {
+    // Distinct per thread, process and host, so that clients that fail
+    // together do not retry in lockstep.
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t seed = ts.tv_nsec ^ ((uint64_t) ts.tv_sec << 20) ^
+      ((uint64_t) getpid() << 32) ^ (uint64_t) (uintptr_t) this;
+    jitter[0] = seed;
+    jitter[1] = seed >> 16;
+    jitter[2] = (seed >> 32) ^ (seed >> 48);
+  }
+};
+
+struct pending_connect {
+  struct connector *c;
+  Connection *conn;
+  bool lead;            // First connection to its server.
+  int attempts;
+  double start;         // Of the current attempt.
+  struct event *retry;  // Backoff timer.
+  struct event *timeout; // --connect_timeout for the current attempt.
+  bool connected;
+};
+
+void connector_fill(struct connector *c);
+
+void connector_failed(struct pending_connect *p) {
+  p->attempts++;
+
+  if (p->attempts >= args.connect_retries_arg) {
+    W("Giving up on a connection to %s after %d attempts.",
+      p->conn->server().c_str(), p->attempts);
+    p->c->resolved++;
+    return;
+  }
+
+  double delay = CONNECT_BACKOFF;
+  for (int i = 1; i < p->attempts && delay < CONNECT_BACKOFF_MAX; i++)
+    delay *= 2;
+  if (delay > CONNECT_BACKOFF_MAX) delay = CONNECT_BACKOFF_MAX;
+  delay *= 0.5 + erand48(p->c->jitter);
+
+  struct timeval tv;
+  double_to_tv(delay, &tv);
+  evtimer_add(p->retry, &tv);
+  p->c->retries++;
+}
+
+void connect_retry_cb(evutil_socket_t fd, short what, void *ptr) {
+  struct pending_connect *p = (struct pending_connect *) ptr;
+
+  p->c->waiting.push_back(p);
+  connector_fill(p->c);
+}
+
+void connect_timeout_cb(evutil_socket_t fd, short what, void *ptr) {
+  struct pending_connect *p = (struct pending_connect *) ptr;
+
+  // Reports back through connect_done_cb().
+  p->conn->abort_connect();
+}
+
+void connect_done_cb(Connection *conn, bool connected, void *arg) {
+  struct pending_connect *p = (struct pending_connect *) arg;
+  struct connector *c = p->c;
+
+  c->inflight--;
+  evtimer_del(p->timeout);
+
+  if (connected) {
+    D("Connected to %s.", conn->server().c_str());
+    c->latency.push_back(get_time() - p->start);
+    p->connected = true;
+    c->resolved++;
+  } else {
+    connector_failed(p);
+  }
+
+  connector_fill(c);
+}
+
+void connector_fill(struct connector *c) {
+  while (c->waiting.size() > 0 &&
+         (args.connect_inflight_arg <= 0 ||
+          c->inflight < args.connect_inflight_arg)) {
+    struct pending_connect *p = c->waiting.front();
+    c->waiting.pop_front();
+
+    p->start = get_time();
+    c->inflight++;
+    if (!p->conn->do_connect()) {
+      c->inflight--;
+      connector_failed(p);
+    } else if (args.connect_timeout_arg > 0) {
+      struct timeval tv;
+      double_to_tv(args.connect_timeout_arg, &tv);
+      evtimer_add(p->timeout, &tv);
+    }
+  }
+}
+
+void connector_report(struct connector *c, int total, double elapsed) {
+  vector<double> &l = c->latency;
+  int failed = total - (int) l.size();
+
+  sort(l.begin(), l.end());
+  if (l.size() > 0)
+    V("Connected %d/%d in %.2fs, %d retries; connect ms: "
+      "50th %.2f 90th %.2f 99th %.2f max %.2f",
+      (int) l.size(), total, elapsed, c->retries,
+      l[l.size() * 50 / 100] * 1000, l[l.size() * 90 / 100] * 1000,
+      l[l.size() * 99 / 100] * 1000, l.back() * 1000);
+
+  if (failed > 0)
+    W("%d of %d connections could not be established.", failed, total);
+}
 
+/**
+ * Create a thread's event loop and connections, wait for them to be
+ * established and load the database.
+ */
+void worker_setup(struct worker &w, const vector<string>& servers,
+                  options_t& options, ConcurrentQueue<string> *trace_queue) {
   char *saveptr = NULL;  // For reentrant strtok().
 
-  struct event_base *base;
-  struct evdns_base *evdns;
-  struct event_config *config;
+  w.loop_flag =
+    (options.blocking || args.blocking_given) ? EVLOOP_ONCE : EVLOOP_NONBLOCK;
+  w.finished = 0;
 
-  if ((config = event_config_new()) == NULL) DIE("event_config_new() fail");
+  if ((w.config = event_config_new()) == NULL) DIE("event_config_new() fail");
 
 #ifdef HAVE_DECL_EVENT_BASE_FLAG_PRECISE_TIMER
-  if (event_config_set_flag(config, EVENT_BASE_FLAG_PRECISE_TIMER))
+  if (event_config_set_flag(w.config, EVENT_BASE_FLAG_PRECISE_TIMER))
     DIE("event_config_set_flag(EVENT_BASE_FLAG_PRECISE_TIMER) fail");
 #endif
 
-  if ((base = event_base_new_with_config(config)) == NULL)
+  if ((w.base = event_base_new_with_config(w.config)) == NULL)
     DIE("event_base_new() fail");
 
   //  evthread_use_pthreads();
 
-  if ((evdns = evdns_base_new(base, 1)) == 0) DIE("evdns");
+  if ((w.evdns = evdns_base_new(w.base, 1)) == 0) DIE("evdns");
+
+  w.counters = new MemCounters();
+  mem_stats before = w.counters->read();
+
+  w.arena = NULL;
+  if (args.hugepages_given) {
+    if (args.arena_size_arg <= 0) DIE("--arena_size must be positive.");
+    w.arena = new Arena((size_t) args.arena_size_arg << 20);
+    Arena::set_current(w.arena);
+    V("Arena: %d MB on %s.", args.arena_size_arg,
+      w.arena->hugetlb() ? "hugetlb pages" : "transparent hugepages");
+  }
+
+  w.engine = IOEngine::create(options, w.base);
+  w.context = new ConnectionContext(options, w.base,
+                                    !args.agentmode_given || probe_role);
+  if (profile) w.context->interval = new ConnectionStats();
 
   //  event_base_priority_init(base, 2);
 
-  // FIXME: May want to move this to after all connections established.
-  double start = get_time();
-  double now = start;
+  struct event_base *base = w.base;
+  IOEngine *engine = w.engine;
+  vector<Connection*> &connections = w.connections;
+  vector<Connection*> &server_lead = w.server_lead;
 
-  vector<Connection*> connections;
-  vector<Connection*> server_lead;
+  struct connector connector;
+  vector<struct pending_connect> pending;
 
   for (auto s: servers) {
     // Split args.server_arg[s] into host:port using strtok().
@@ -1046,52 +2549,79 @@ void do_mutilate(const vector<string>& servers, options_t& options,
     int conns = args.measure_connections_given ? args.measure_connections_arg :
       options.connections;
 
-    srand(time(NULL));
     for (int c = 0; c < conns; c++) {
-      Connection* conn = new Connection(base, evdns, hostname, port, options,
-                                        trace_queue,
-                                        args.agentmode_given ? false :
-                                        true);
-      int tries = 120;
-      int connected = 0;
-      int s = 2;
-      for (int i = 0; i < tries; i++) {
-        pthread_mutex_lock(&flock);
-        int ret = conn->do_connect();
-        pthread_mutex_unlock(&flock);
-        if (ret) {
-            connected = 1;
-            fprintf(stderr,"thread %lu, conn: %d, connected!\n",pthread_self(),c);
-            break;
-        }
-        int d = s + rand() % 100;
-        //s = s + d;
-        
-        //fprintf(stderr,"conn: %d, sleeping %d\n",c,d);
-        sleep(d);
-      } 
-      if (connected) {
-        connections.push_back(conn);
-      } else {
-        fprintf(stderr,"conn: %d, not connected!!\n",c);
+      struct pending_connect p;
+      p.c = &connector;
+      p.conn = new Connection(base, w.evdns, hostname, port, w.context,
+                              trace_queue, engine);
+      p.lead = c == 0;
+      pending.push_back(p);
+    }
+  }
 
-      }
-      if (c == 0) server_lead.push_back(conn);
+  // Connect everything, --connect_inflight at a time.
+  double setup_start = get_time();
+
+  for (auto &p: pending) {
+    p.attempts = 0;
+    p.connected = false;
+    p.retry = evtimer_new(base, connect_retry_cb, &p);
+    p.timeout = evtimer_new(base, connect_timeout_cb, &p);
+    p.conn->connect_cb = connect_done_cb;
+    p.conn->connect_arg = &p;
+    connector.waiting.push_back(&p);
+  }
+
+  connector_fill(&connector);
+  while (connector.resolved < (int) pending.size())
+    engine->loop(base, EVLOOP_ONCE);
+
+  connector_report(&connector, pending.size(), get_time() - setup_start);
+
+  Connection *lead = NULL;
+  set<ConnectionStats*> live;
+  for (auto &p: pending) {
+    event_free(p.retry);
+    event_free(p.timeout);
+    p.conn->connect_cb = NULL;
+
+    // Load through the first connection to each server that came up.
+    if (p.lead) lead = NULL;
+    if (!p.connected) {
+      delete p.conn;
+      continue;
+    }
+
+    p.conn->finished_count = &w.finished;
+    live.insert(&p.conn->stats);
+    connections.push_back(p.conn);
+    if (lead == NULL) {
+      lead = p.conn;
+      server_lead.push_back(lead);
     }
   }
 
-  // Wait for all Connections to become IDLE.
-  while (1) {
-    // FIXME: If all connections become ready before event_base_loop
-    // is called, this will deadlock.
-    event_base_loop(base, EVLOOP_ONCE);
+  if (connections.size() == 0) DIE("No connections could be established.");
+
+  report_mem_stats("Setup", before, w.counters->read());
+  if (w.arena) V("Arena: %zu KB in use.", w.arena->used() / 1024);
 
+  // Drop the stats of servers and connections that never came up, so
+  // they do not show in the breakdown.
+  for (auto i = w.context->stats.begin(); i != w.context->stats.end();) {
+    if (live.count(&i->second)) i++;
+    else i = w.context->stats.erase(i);
+  }
+
+  // Wait for all Connections to become IDLE.  Most already are by now,
+  // so check before blocking in the event loop.
+  while (1) {
     bool restart = false;
     for (Connection *conn: connections)
       if (!conn->is_ready()) restart = true;
 
-    if (restart) continue;
-    else break;
+    if (!restart) break;
+    engine->loop(base, EVLOOP_ONCE);
   }
 
   // Load database on lead connection for each server.
@@ -1100,33 +2630,203 @@ void do_mutilate(const vector<string>& servers, options_t& options,
 
     for (auto c: server_lead) c->start_loading();
 
-    // Wait for all Connections to become IDLE.
+    // Wait for all Connections to become IDLE.  A lead connection
+    // goes IDLE on its first reply, so also wait for the rest.
     while (1) {
       // FIXME: If all connections become ready before event_base_loop
       // is called, this will deadlock.
-      event_base_loop(base, EVLOOP_ONCE);
+      engine->loop(base, EVLOOP_ONCE);
 
       bool restart = false;
       for (Connection *conn: connections)
-        if (!conn->is_ready()) restart = true;
+        if (!conn->is_ready() || !conn->is_drained()) restart = true;
 
       if (restart) continue;
       else break;
     }
+
+    // The loader's sets are not part of any measurement.
+    w.context->reset_stats();
   }
+}
+
+// End of --warmup in a timed run.  Connections carry on without a
+// pause, but the stats window starts over: requests issued before it
+// are dropped from the stats as they complete.
+struct warmup_end {
+  struct event *timer;
+  struct worker *w;
+  struct lag_probe *probe;
+  double measure_start;
+  bool master;
+};
+
+void warmup_end_cb(evutil_socket_t fd, short what, void *ptr) {
+  struct warmup_end *we = (struct warmup_end *) ptr;
+  struct timeval tv;
+
+  we->w->context->reset_stats();
+#if HAVE_CLOCK_GETTIME
+  we->w->context->window_start = get_time_accurate();
+#else
+  we->w->context->window_start = get_time();
+#endif
+  we->measure_start = get_time();
+
+  we->probe->due = we->measure_start + LAG_PROBE_INTERVAL;
+  double_to_tv(LAG_PROBE_INTERVAL, &tv);
+  evtimer_add(we->probe->timer, &tv);
+
+  if (we->master) V("Warmup stop.");
+}
+
+// Per-thread timer that moves the request rate along --profile every
+// --profile_interval, and hands in the stats of the step just ended.
+struct profile_timer {
+  struct event *timer;
+  struct worker *w;
+  double begin;      // get_time() at the profile's t = 0.
+  double length;     // Of the measurement, in seconds.
+  double scale;      // Per-connection lambda per aggregate QPS.
+  int step;          // Being recorded; -1 before begin.
+  double step_start;
+};
+
+void profile_deposit(struct profile_timer *pt, double now) {
+  ConnectionStats *interval = pt->w->context->interval;
+  if (interval == NULL) return;
+
+  interval->start = pt->step_start;
+  interval->stop = now;
 
-  if (options.loadonly) {
-    evdns_base_free(evdns, 0);
-    event_base_free(base);
+  pthread_mutex_lock(&profile_lock);
+  if ((int) profile_steps.size() <= pt->step)
+    profile_steps.resize(pt->step + 1);
+  profile_steps[pt->step].stats.accumulate(*interval);
+  pthread_mutex_unlock(&profile_lock);
+
+  *interval = ConnectionStats();
+}
+
+void profile_cb(evutil_socket_t fd, short what, void *ptr) {
+  struct profile_timer *pt = (struct profile_timer *) ptr;
+  ConnectionStats *interval = pt->w->context->interval;
+  double now = get_time();
+  struct timeval tv;
+
+  if (pt->step >= 0) profile_deposit(pt, now);
+  else if (interval) *interval = ConnectionStats();
+
+  double t = (pt->step + 1) * args.profile_interval_arg;
+  if (t >= pt->length) {
+    pt->step = -1;
     return;
   }
 
+  pt->step++;
+  pt->step_start = now;
+  pt->w->context->set_lambda(profile->qps(t) * pt->scale *
+                             pt->w->lambda_scale);
+
+  // From begin rather than now, so that steps do not drift.
+  double_to_tv(max(0.0, pt->begin + t + args.profile_interval_arg - now), &tv);
+  evtimer_add(pt->timer, &tv);
+}
+
+// Per-thread timer that updates the thread's heartbeat_slot every
+// --heartbeat on an agent.
+struct heartbeat_timer {
+  struct event *timer;
+  struct worker *w;
+  struct lag_probe *probe;
+  double last;
+  uint64_t ops;  // Completed by the last beat.
+  heartbeat_slot slot;
+};
+
+void heartbeat_cb(evutil_socket_t fd, short what, void *ptr) {
+  struct heartbeat_timer *hb = (struct heartbeat_timer *) ptr;
+  ConnectionContext *context = hb->w->context;
+  double now = get_time();
+  struct timeval tv;
+
+  uint64_t ops = 0, skips = 0;
+  for (auto &s: context->stats) {
+    ops += s.second.gets + s.second.sets;
+    skips += s.second.skips;
+  }
+  if (ops < hb->ops) hb->ops = 0;  // Stats restarted after --warmup.
+
+  size_t outstanding = 0;
+  for (Connection *conn: hb->w->connections)
+    outstanding += conn->outstanding();
+
+  pthread_mutex_lock(&heartbeat_lock);
+  double scale = lambda_scale;
+  pthread_mutex_unlock(&heartbeat_lock);
+
+  if (scale != hb->w->lambda_scale && context->options.lambda > 0) {
+    context->set_lambda(context->options.lambda * scale /
+                        hb->w->lambda_scale);
+    hb->w->lambda_scale = scale;
+  }
+
+  pthread_mutex_lock(&heartbeat_lock);
+  hb->slot.fresh = false;
+  hb->slot.qps = (ops - hb->ops) / (now - hb->last);
+  hb->slot.target = context->options.lambda > 0 ?
+    context->options.lambda * hb->w->connections.size() : 0;
+  hb->slot.share = hb->slot.target / hb->w->lambda_scale;
+  hb->slot.outstanding = outstanding;
+  hb->slot.lag = hb->probe->max_lag;
+  hb->slot.skips = skips;
+  pthread_mutex_unlock(&heartbeat_lock);
+
+  hb->probe->max_lag = 0;
+  hb->ops = ops;
+  hb->last = now;
+
+  double_to_tv(heartbeat_interval, &tv);
+  evtimer_add(hb->timer, &tv);
+}
+
+/**
+ * Warm up, run one measurement and accumulate its stats.  The
+ * connections stay open; see worker_drain() for running again.
+ *
+ * A timed run warms up and measures as one continuous run, so that the
+ * server sees no gap or burst between the two.  Runs that end on
+ * --queries or a trace warm up separately and drain first, since the
+ * measurement has to start from a fresh count.
+ */
+void worker_run(struct worker &w, options_t& options,
+                ConnectionStats& stats, map<string, ConnectionStats>& server_stats,
+                bool master
+#ifdef HAVE_LIBZMQ
+, zmq::socket_t* socket
+#endif
+) {
+  struct event_base *base = w.base;
+  IOEngine *engine = w.engine;
+  int loop_flag = w.loop_flag;
+  vector<Connection*> &connections = w.connections;
+  int &finished = w.finished;
+
+  double start = get_time();
+  double now = start;
+  bool continuous = options.warmup > 0 && options.queries == 0 &&
+    !options.read_file;
+
   // FIXME: Remove.  Not needed, testing only.
   //  // FIXME: Synchronize start_time here across threads/nodes.
   //  pthread_barrier_wait(&barrier);
 
+  w.context->window_start = 0;
+  w.lambda_scale = 1;
+  mem_stats before = w.counters->read();
+
   // Warmup connection.
-  if (options.warmup > 0) {
+  if (options.warmup > 0 && !continuous) {
     if (master) V("Warmup start.");
 
 #ifdef HAVE_LIBZMQ
@@ -1137,8 +2837,9 @@ void do_mutilate(const vector<string>& servers, options_t& options,
       // 2. sync agents: all threads across all agents are now ready
       // 3. thread barrier: don't release our threads until all agents ready
       pthread_barrier_wait(&barrier);
-      if (master) sync_agent(socket);
+      if (master) sync_start = sync_agent(socket);
       pthread_barrier_wait(&barrier);
+      wait_until(sync_start);
 
       if (master) V("Synchronized.");
     }
@@ -1148,31 +2849,15 @@ void do_mutilate(const vector<string>& servers, options_t& options,
     //    options.time = 1;
 
     start = get_time();
+    finished = 0;
+    w.context->options.time = options.warmup;
     for (Connection *conn: connections) {
       conn->start_time = start;
-      conn->options.time = options.warmup;
       conn->start(); // Kick the Connection into motion.
     }
 
-    while (1) {
-      event_base_loop(base, loop_flag);
-
-      //#ifdef USE_CLOCK_GETTIME
-      //      now = get_time();
-      //#else
-      struct timeval now_tv;
-      event_base_gettimeofday_cached(base, &now_tv);
-      now = tv_to_double(&now_tv);
-      //#endif
-
-      bool restart = false;
-      for (Connection *conn: connections)
-        if (!conn->check_exit_condition(now))
-          restart = true;
-
-      if (restart) continue;
-      else break;
-    }
+    run_until_finished(engine, base, loop_flag, connections, finished,
+                       start, options.warmup);
 
     bool restart = false;
     for (Connection *conn: connections)
@@ -1186,7 +2871,7 @@ void do_mutilate(const vector<string>& servers, options_t& options,
       // become ready before event_base_loop is called, this will
       // deadlock.  We should check for IDLE before calling
       // event_base_loop.
-      event_base_loop(base, EVLOOP_ONCE); // EVLOOP_NONBLOCK);
+      engine->loop(base, EVLOOP_ONCE); // EVLOOP_NONBLOCK);
 
       bool restart = false;
       for (Connection *conn: connections)
@@ -1197,10 +2882,9 @@ void do_mutilate(const vector<string>& servers, options_t& options,
     }
     }
 
-    for (Connection *conn: connections) {
-      conn->reset();
-      conn->options.time = old_time;
-    }
+    for (Connection *conn: connections) conn->reset();
+    w.context->reset_stats();
+    w.context->options.time = old_time;
 
     if (master) V("Warmup stop.");
   }
@@ -1222,8 +2906,9 @@ void do_mutilate(const vector<string>& servers, options_t& options,
     if (master) V("Synchronizing.");
 
     pthread_barrier_wait(&barrier);
-    if (master) sync_agent(socket);
+    if (master) sync_start = sync_agent(socket);
     pthread_barrier_wait(&barrier);
+    wait_until(sync_start);
 
     if (master) V("Synchronized.");
   }
@@ -1232,50 +2917,305 @@ void do_mutilate(const vector<string>& servers, options_t& options,
   if (master && !args.scan_given && !args.search_given)
     V("started at %f", get_time());
 
+  int run_time = options.time;
+  if (continuous) {
+    if (master) V("Warmup start.");
+    run_time += options.warmup;
+    w.context->options.time = run_time;
+  }
+
   start = get_time();
+  finished = 0;
   for (Connection *conn: connections) {
     conn->start_time = start;
     conn->start(); // Kick the Connection into motion.
   }
 
+  struct lag_probe probe;
+  struct timeval probe_tv;
+  probe.stats = &stats;
+  probe.max_lag = 0;
+  probe.timer = evtimer_new(base, lag_probe_cb, &probe);
+
+  struct warmup_end we;
+  we.timer = NULL;
+  if (continuous) {
+    we.w = &w;
+    we.probe = &probe;
+    we.master = master;
+    we.timer = evtimer_new(base, warmup_end_cb, &we);
+    double_to_tv(options.warmup, &probe_tv);
+    evtimer_add(we.timer, &probe_tv);
+  } else {
+    probe.due = start + LAG_PROBE_INTERVAL;
+    double_to_tv(LAG_PROBE_INTERVAL, &probe_tv);
+    evtimer_add(probe.timer, &probe_tv);
+  }
+
+  // A --profile starts with the measurement, at the rate options.qps
+  // already has.  The master's own rate is fixed by --measure_qps.
+  struct profile_timer prof;
+  prof.timer = NULL;
+  if (profile && options.qps > 0 && !args.measure_qps_given) {
+    prof.w = &w;
+    prof.begin = start + (continuous ? options.warmup : 0);
+    prof.length = options.time;
+    prof.scale = options.lambda / options.qps;
+    prof.step = -1;
+    prof.timer = evtimer_new(base, profile_cb, &prof);
+    double_to_tv(max(0.0, prof.begin - get_time()), &probe_tv);
+    evtimer_add(prof.timer, &probe_tv);
+  }
+
+  struct heartbeat_timer hb;
+  hb.timer = NULL;
+  if (args.agentmode_given && heartbeat_interval > 0) {
+    hb.w = &w;
+    hb.probe = &probe;
+    hb.last = start;
+    hb.ops = 0;
+    hb.slot.fresh = true;
+    hb.timer = evtimer_new(base, heartbeat_cb, &hb);
+    double_to_tv(heartbeat_interval, &probe_tv);
+    evtimer_add(hb.timer, &probe_tv);
+
+    pthread_mutex_lock(&heartbeat_lock);
+    heartbeat_slots.push_back(&hb.slot);
+    pthread_mutex_unlock(&heartbeat_lock);
+  }
+
   //  V("Start = %f", start);
 
   // Main event loop.
-  while (1) {
-    event_base_loop(base, loop_flag);
-
-    //#if USE_CLOCK_GETTIME
-    //    now = get_time();
-    //#else
-    struct timeval now_tv;
-    event_base_gettimeofday_cached(base, &now_tv);
-    now = tv_to_double(&now_tv);
-    //#endif
+  run_until_finished(engine, base, loop_flag, connections, finished,
+                     start, run_time);
+  now = get_time();
+
+  if (hb.timer) {
+    pthread_mutex_lock(&heartbeat_lock);
+    heartbeat_slots.erase(find(heartbeat_slots.begin(),
+                               heartbeat_slots.end(), &hb.slot));
+    pthread_mutex_unlock(&heartbeat_lock);
+    event_free(hb.timer);
+    if (w.lambda_scale != 1) w.context->set_lambda(options.lambda);
+  }
 
-    bool restart = false;
-    for (Connection *conn: connections)
-      if (!conn->check_exit_condition(now))
-        restart = true;
+  if (prof.timer) {
+    if (prof.step >= 0) profile_deposit(&prof, now);
+    event_free(prof.timer);
+    w.context->set_lambda(options.lambda);
+  }
 
-    if (restart) continue;
-    else break;
+  if (we.timer) {
+    if (evtimer_pending(we.timer, NULL)) warmup_end_cb(-1, 0, &we);
+    event_free(we.timer);
+    start = we.measure_start;
+    w.context->options.time = options.time;
   }
 
+  event_free(probe.timer);
+
   if (master && !args.scan_given && !args.search_given)
     V("stopped at %f  options.time = %d", get_time(), options.time);
 
-  // Tear-down and accumulate stats.
-  for (Connection *conn: connections) {
-    stats.accumulate(conn->stats);
-    delete conn;
+  report_mem_stats("Run", before, w.counters->read());
+
+  // Accumulate stats.  Connections record straight into their server's
+  // stats in the shared context, so there is one merge per server
+  // rather than per connection.  With --connection_stats, each has its
+  // own, which also counts towards its server here.
+  for (auto &s: w.context->stats) {
+    server_stats[s.first].accumulate(s.second);
+
+    size_t hash = s.first.find('#');
+    if (hash != string::npos)
+      server_stats[s.first.substr(0, hash)].accumulate(s.second);
+  }
+
+  for (auto &s: server_stats) {
+    s.second.start = start;
+    s.second.stop = now;
+    if (s.first.find('#') == string::npos) stats.accumulate(s.second);
   }
 
   stats.start = start;
   stats.stop = now;
+}
+
+/**
+ * Let requests still in flight at the end of a run complete, then
+ * reset the connections for the next worker_run().
+ */
+void worker_drain(struct worker &w) {
+  while (1) {
+    bool restart = false;
+    for (Connection *conn: w.connections)
+      if (!conn->is_drained()) restart = true;
+
+    if (!restart) break;
+    w.engine->loop(w.base, EVLOOP_ONCE);
+  }
+
+  for (Connection *conn: w.connections) conn->reset();
+  w.context->reset_stats();
+}
+
+void worker_teardown(struct worker &w) {
+#ifdef __linux__
+  check_rx_locality(w.connections);
+#endif
+
+  size_t bytes = 0;
+  for (Connection *conn: w.connections) bytes += conn->footprint();
+  V("Connection state: %zu bytes each, %zu KB for %d connections.",
+    bytes / w.connections.size(), bytes / 1024, (int) w.connections.size());
+
+  // Connections go back to the arena, so before it is unmapped.
+  for (Connection *conn: w.connections) delete conn;
+  w.connections.clear();
+
+  delete w.context;
+  delete w.engine;
+  event_config_free(w.config);
+  evdns_base_free(w.evdns, 0);
+  event_base_free(w.base);
+
+  delete w.arena;
+  delete w.counters;
+}
+
+/*
+ * Report one thread's page faults and dTLB misses between two readings
+ * of its MemCounters, e.g. to compare runs with and without --hugepages.
+ */
+void report_mem_stats(const char *what, const mem_stats &before,
+                      const mem_stats &after) {
+  char tlb[32] = "n/a";
+  if (before.dtlb_misses >= 0 && after.dtlb_misses >= 0)
+    snprintf(tlb, sizeof(tlb), "%lld", after.dtlb_misses - before.dtlb_misses);
+
+  V("%s: %ld minor / %ld major page faults, %s dTLB misses.", what,
+    after.minor_faults - before.minor_faults,
+    after.major_faults - before.major_faults, tlb);
+}
+
+/*
+ * Read latency as each --probe saw it, one line per probe like --scan's.
+ */
+void print_probes() {
+  printf("\n%-7s %7s %7s %7s %7s %7s %7s %7s %7s %7s %7s %8s\n",
+         "#probe", "avg", "std", "min", "5th", "10th", "50th", "90th",
+         "95th", "99th", "99.9th", "QPS");
+
+  for (auto &p: probe_stats) {
+    p.second.print_stats(p.first.c_str(), p.second.get_sampler, false);
+    printf(" %8.1f\n", p.second.get_qps());
+  }
+}
+
+/*
+ * One line per step of --profile, like --scan's, over every client.
+ */
+void print_profile() {
+  printf("%-7s %7s %7s %7s %7s %7s %7s %7s %7s %7s %7s %8s %8s\n",
+         "#time", "avg", "std", "min", "5th", "10th", "50th", "90th",
+         "95th", "99th", "99.9th", "QPS", "target");
+
+  for (size_t i = 0; i < profile_steps.size(); i++) {
+    ConnectionStats &s = profile_steps[i].stats;
+    double t = i * args.profile_interval_arg;
+    char tag[16];
+
+    // From the profile, not the steps: steps that only agents recorded
+    // (--measure_qps, --threads 0) never ran profile_deposit() here.
+    snprintf(tag, sizeof(tag), "%.1f", t);
+    s.print_stats(tag, s.get_sampler, false);
+    printf(" %8.1f %8.1f\n", s.get_qps(), profile->qps(t));
+  }
+
+  printf("\n");
+}
+
+/*
+ * Print one thread's event loop lag and warn if it is large enough,
+ * relative to the latency the thread measured, to distort results.
+ */
+void report_loop_lag(int thread, ConnectionStats &stats) {
+  LogHistogramSampler &lag = stats.lag_sampler;
+  if (lag.total() == 0) return;
+
+  if (args.loop_lag_given) {
+    if (thread == 0)
+      printf("%-7s %7s %7s %7s %7s %7s %7s\n", "#lag", "avg", "50th",
+             "90th", "99th", "99.9th", "max");
+    printf("%-7d %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f\n", thread,
+           lag.average(), lag.get_nth(50), lag.get_nth(90), lag.get_nth(99),
+           lag.get_nth(99.9), stats.lag_max);
+  }
+
+  double lag99 = lag.get_nth(99);
+  double lat99 = stats.get_nth(99);
+
+  if (lat99 > 0 && lag99 > args.lag_warn_arg * lat99 &&
+      lag99 > args.lag_warn_floor_arg)
+    W("Thread %d: 99th event loop lag %.1fus is %.0f%% of its 99th latency "
+      "%.1fus; this client is overloaded, do not trust its latency.",
+      thread, lag99, lag99 / lat99 * 100, lat99);
+}
+
+/*
+ * Print the per-server (and per-connection) breakdown of the last run
+ * and warn about servers whose 99th percentile or QPS is more than
+ * --imbalance times away from the median server.
+ */
+void report_server_stats(bool print) {
+  vector<double> p99s, qpss;
+
+  for (auto &s: server_stats) {
+    if (s.first.find('#') != string::npos) continue;
+    p99s.push_back(s.second.get_nth(99));
+    qpss.push_back(s.second.get_qps());
+  }
+
+  if (print) {
+    printf("\n%-30s %9s %7s %7s %7s %7s %7s\n", "#server", "QPS", "miss%",
+           "50th", "90th", "99th", "99.9th");
+
+    for (auto &s: server_stats) {
+      ConnectionStats &cs = s.second;
+      bool conn = s.first.find('#') != string::npos;
+
+      printf("%s%-*s %9.1f %7.1f %7.1f %7.1f %7.1f %7.1f\n",
+             conn ? "  " : "", conn ? 28 : 30, s.first.c_str(),
+             cs.get_qps(), cs.gets ? (double) cs.get_misses / cs.gets * 100 : 0.0,
+             cs.get_nth(50), cs.get_nth(90), cs.get_nth(99), cs.get_nth(99.9));
+    }
+  }
 
-  event_config_free(config);
-  evdns_base_free(evdns, 0);
-  event_base_free(base);
+  if (p99s.size() < 2) return;
+
+  sort(p99s.begin(), p99s.end());
+  sort(qpss.begin(), qpss.end());
+  double median_p99 = p99s[p99s.size() / 2];
+  double median_qps = qpss[qpss.size() / 2];
+  double factor = args.imbalance_arg;
+
+  for (auto &s: server_stats) {
+    if (s.first.find('#') != string::npos) continue;
+
+    double p99 = s.second.get_nth(99);
+    double qps = s.second.get_qps();
+
+    if (median_p99 > 0 && (p99 > median_p99 * factor ||
+                           p99 < median_p99 / factor))
+      W("Imbalance: %s 99th = %.1fus, median server 99th = %.1fus",
+        s.first.c_str(), p99, median_p99);
+
+    if (median_qps > 0 && (qps > median_qps * factor ||
+                           qps < median_qps / factor))
+      W("Imbalance: %s QPS = %.1f, median server QPS = %.1f",
+        s.first.c_str(), qps, median_qps);
+  }
 }
 
 void args_to_options(options_t* options) {
@@ -1283,8 +3223,9 @@ void args_to_options(options_t* options) {
   options->connections = args.connections_arg;
   options->blocking = args.blocking_given;
   options->qps = args.qps_arg;
+  if (profile) options->qps = max(1, (int) lround(profile->qps(0)));
   options->threads = args.threads_arg;
-  options->server_given = args.server_given;
+  options->server_given = args.server_given + (args.loopback_given ? 1 : 0);
   options->roundrobin = args.roundrobin_given;
 
   int connections = options->connections;
@@ -1374,6 +3315,12 @@ void args_to_options(options_t* options) {
   options->oob_thread = false;
   options->skip = args.skip_given;
   options->moderate = args.moderate_given;
+  options->hotkeys = args.hotkeys_arg;
+  options->wire_timestamps = args.wire_timestamps_given;
+  options->kernel_timestamps = args.kernel_timestamps_given;
+  strcpy(options->engine, args.engine_arg);
+  options->busy_poll = args.busy_poll_arg;
+  options->so_busy_poll = args.so_busy_poll_given ? args.so_busy_poll_arg : 0;
 }
 
 void init_random_stuff() {
@@ -1382,6 +3329,13 @@ void init_random_stuff() {
 
   size_t cursor = 0;
 
+#ifdef MADV_HUGEPAGE
+  // Before the first touch, so that it is faulted in as one page.
+  if (args.hugepages_given &&
+      madvise(random_char, sizeof(random_char), MADV_HUGEPAGE))
+    D("madvise(random_char, MADV_HUGEPAGE): %s", strerror(errno));
+#endif
+
   while (cursor < sizeof(random_char)) {
     size_t max = sizeof(lorem);
     if (sizeof(random_char) - cursor < max)
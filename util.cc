@@ -10,6 +10,11 @@ void sleep_time(double duration) {
   if (duration > 0) usleep((useconds_t) (duration * 1000000));
 }
 
+void wait_until(double when) {
+  sleep_time(when - get_time() - 0.001);
+  while (get_time() < when) ;
+}
+
 #define FNV_64_PRIME (0x100000001b3ULL)
 #define FNV1_64_INIT (0xcbf29ce484222325ULL)
 uint64_t fnv_64_buf(const void* buf, size_t len) {
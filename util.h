@@ -43,6 +43,7 @@ inline double get_time() {
 }
 
 void sleep_time(double duration);
+void wait_until(double when);  // get_time() instant; spins the last 1ms.
 
 uint64_t fnv_64_buf(const void* buf, size_t len);
 inline uint64_t fnv_64(uint64_t in) { return fnv_64_buf(&in, sizeof(in)); }